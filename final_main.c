@@ -1,11 +1,188 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define min(a,b) (((a)<(b))?(a):(b))
 #define max(a,b) (((a)>(b))?(a):(b))
 
 #define TEXT_BLOCK_SIZE 32
 #define EDIT_BLOCK_SIZE 8
+#define SHRINK_RATIO 4
+#define ARENA_CHUNK_SIZE (1 << 20)
+#define INTERN_BLOCK_SIZE 1024
+
+// Store identical lines only once. Off by default: every new line then
+// costs a table entry and a lookup, which only pays off when most lines
+// repeat (REPORT_STATS shows the bytes it saved).
+#ifndef INTERN_LINES
+#define INTERN_LINES 0
+#endif
+
+// Line handles are 32 bit references to the arena (in 4 byte units, so the
+// arena can address up to 16GB of lines, stored over the whole session)
+// instead of body and length
+#ifndef COMPACT_LINES
+#define COMPACT_LINES 0
+#endif
+#define ARENA_LIMIT (4LL << 32)
+
+// Keep lines of up to INLINE_SIZE bytes inside the line handle
+#ifndef INLINE_LINES
+#define INLINE_LINES !COMPACT_LINES
+#endif
+#define INLINE_SIZE 23
+#define INLINE 0x80
+
+#if COMPACT_LINES && INLINE_LINES
+#error "INLINE_LINES needs full line handles (COMPACT_LINES == 0)"
+#endif
+
+// Pack the history records of states far behind the current one into
+// compressed blocks of COLD_BLOCK_STATES states
+#ifndef COLD_HISTORY
+#define COLD_HISTORY 1
+#endif
+#ifndef COLD_DISTANCE
+#define COLD_DISTANCE 4096
+#endif
+#ifndef COLD_BLOCK_STATES
+#define COLD_BLOCK_STATES 256
+#endif
+#define LZ_HASH_BITS 14
+#define LZ_MIN_MATCH 4
+
+// Move packed blocks SPILL_DISTANCE states behind the current one to an
+// append only log file, mapping them back in when undo/redo gets there
+#ifndef DISK_HISTORY
+#define DISK_HISTORY 0
+#endif
+#ifndef SPILL_DISTANCE
+#define SPILL_DISTANCE (1 << 16)
+#endif
+#if DISK_HISTORY && !COLD_HISTORY
+#error "DISK_HISTORY needs COLD_HISTORY"
+#endif
+
+// Spilled blocks take the line bodies they point to along (mapped back in
+// read only), so the arena can let go of them. Interned bodies belong to
+// the table and compact handles only reach the arena: those stay resident.
+#define SPILL_BODIES (DISK_HISTORY && !INTERN_LINES && !COMPACT_LINES)
+// Bodies go to segments of the log BODY_SEGMENT bytes long, each mapped once
+#ifndef BODY_SEGMENT
+#define BODY_SEGMENT (64 << 20)
+#endif
+
+// Print memory counters on stderr when quitting
+#ifndef REPORT_STATS
+#define REPORT_STATS 0
+#endif
+
+// Line store, picked at build time (-DTEXT_STORE=...): flat pointer array,
+// balanced tree of line runs, piece table or pointer array with a gap that
+// follows the edits. All of them implement the text store interface below.
+#define FLAT_STORE 0
+#define TREE_STORE 1
+#define PIECE_STORE 2
+#define GAP_STORE 3
+#ifndef TEXT_STORE
+#define TEXT_STORE TREE_STORE
+#endif
+
+// Keep every version of the tree store: history holds a root per state and
+// undo/redo just switch to it (edits copy the path they touch)
+#ifndef PERSISTENT_TREE
+#define PERSISTENT_TREE 0
+#endif
+#if PERSISTENT_TREE && TEXT_STORE != TREE_STORE
+#error "PERSISTENT_TREE needs TEXT_STORE == TREE_STORE"
+#endif
+
+#if PERSISTENT_TREE
+#define LEAF_SIZE 16
+#else
+#define LEAF_SIZE 64
+#endif
+#define PIECE_SLACK 1024
+#define GAP_SIZE 256
+#define SNAPSHOT_PAGE 1024
+
+// Take a checkpoint of the text once the edits since the last one wrote
+// ck_ratio times as many lines as the document holds (counting it as at
+// least CHECKPOINT_MIN_WORK lines): replaying from it is never much dearer
+// than copying the text. ck_ratio halves whenever an undo/redo lands on a
+// checkpoint and doubles after CHECKPOINT_PATIENCE checkpoints nobody
+// jumped to. Copies never take more memory than the history itself: past
+// that every other checkpoint goes (and ck_ratio doubles).
+#ifndef CHECKPOINTS
+#define CHECKPOINTS 1
+#endif
+#ifndef CHECKPOINT_MIN_WORK
+#define CHECKPOINT_MIN_WORK 1024
+#endif
+#define CHECKPOINT_PATIENCE 8
+#define CHECKPOINT_MAX_RATIO 64
+
+// Keep up to VERSION_CACHE_SIZE of the versions undo/redo jumped away from
+// (VERSION_CACHE_BYTES of line handles at most), evicting the least recently
+// used one first
+#ifndef VERSION_CACHE_SIZE
+#define VERSION_CACHE_SIZE 8
+#endif
+#ifndef VERSION_CACHE_BYTES
+#define VERSION_CACHE_BYTES (32 << 20)
+#endif
+
+// Jump long undo/redo distances with deltas composed over aligned strides
+// of 2^k states (for LIFT_MIN_LEVEL <= k < LIFT_LEVELS), built when first
+// needed: any distance takes O(log d) of them plus a few single steps.
+// They hold at most LIFT_BYTES, the highest strides go first past that.
+// Off by default: checkpoints and the version cache already make most
+// long jumps short.
+#ifndef LIFTED_DELTAS
+#define LIFTED_DELTAS 0
+#endif
+#ifndef LIFT_BYTES
+#define LIFT_BYTES (16 << 20)
+#endif
+#define LIFT_MIN_LEVEL 3
+#define LIFT_LEVELS 24
+
+// Bound the history to HISTORY_DEPTH undo steps and/or HISTORY_BYTES of
+// records and line bodies (0 means no bound): past it, the oldest states
+// are folded into the base snapshot FOLD_STATES at a time
+#ifndef HISTORY_DEPTH
+#define HISTORY_DEPTH 0
+#endif
+#ifndef HISTORY_BYTES
+#define HISTORY_BYTES 0
+#endif
+#define FOLD_STATES COLD_BLOCK_STATES
+
+// Keep the states an edit in the past would discard as a branch of an undo
+// tree. u/r still walk the current branch only, <n>b switches to branch n.
+#ifndef UNDO_TREE
+#define UNDO_TREE 0
+#endif
+
+// An edit in the past that discards more than RECLAIM_STATES states only
+// detaches them, every command then frees up to RECLAIM_STATES of them (0
+// frees them all right away)
+#ifndef RECLAIM_STATES
+#define RECLAIM_STATES 1024
+#endif
+
+#define MARK_LIVE 'm'
+#define MOVE_LIVE 'v'
+
+#define ORIGINAL 'o'
+#define ADDED 'a'
+#define BLANK 'b'
 
 #define CHANGE 'c'
 #define PRINT 'p'
@@ -13,374 +190,3068 @@
 #define QUIT 'q'
 #define UNDO 'u'
 #define REDO 'r'
+#define BRANCH 'b'
 #define SKIP 0
 
 /* ===================================================================== */
 /* typedefs */
 
+#if COMPACT_LINES
+
+// Line handle: arena position of the body / 4, the length is stored right
+// before the body (0 is a blank line)
+typedef struct line{
+    unsigned int ref;
+}line_t;
+
+#elif INLINE_LINES
+
+// Line handle: short lines live in the handle itself (tag = INLINE | length),
+// longer ones keep their body and length as read by getline (tag = 0). The
+// tag belongs to the body struct, so initializing that one clears it too.
+typedef union line{
+    struct{
+        char *body;
+        int length;
+        char pad[INLINE_SIZE - sizeof(char*) - sizeof(int)];
+        unsigned char tag;
+    };
+    char data[INLINE_SIZE];
+}line_t;
+
+#else
+
+// Line handle: body (terminator included) and its length as read by getline
+typedef struct line{
+    char *body;
+    int length;
+}line_t;
+
+#endif
+
+// History record of the edit that made a state, read forward by redo and
+// backward by undo. Its lines follow those of the record before it in the
+// pool of its block's log (lines is the offset of the first one): first
+// the ones it took out of the text, then the ones it wrote. The bodies
+// belong to the arena block of the state that wrote them (and to the
+// intern table entry).
 typedef struct edit{
     char code;
-    int location, size, setlen, fill;
-    char **lines;
+    int location, size;
+    int before, after;  // Text length on either side
+    int taken, fill;    // Lines taken out and written
+    int lines;
 }edit_t;
 
+// Block of line bodies, filled like a stack (bump pointer)
+typedef struct chunk{
+    struct chunk *prev; // Chunk filled before this one
+    long long base;     // Arena position of data[0]
+    int size, used;
+    int sealed;         // Holds what a compaction kept: only the next one frees it
+    int spare;          // (keeps data 8 byte aligned)
+    char data[];
+}chunk_t;
+
+// Interned line, lives in the arena right before its body
+typedef struct entry{
+    struct entry *next; // Next entry in the same bucket
+    unsigned int hash;
+    int refs;           // States that wrote this line
+    int stamp;          // Stamp of the state that stored it
+#if COMPACT_LINES
+    line_t line;        // Handle of the body
+#endif
+    int length;         // Body length (terminator excluded), right before it
+    char body[];
+}entry_t;
+
+// History log of COLD_BLOCK_STATES consecutive states: the records they
+// wrote, in order, and the lines of all of them in one pool. Both can be
+// packed into a compressed buffer.
+typedef struct block{
+    edit_t *edits;          // Records (NULL while packed)
+    int e_len, e_cap;
+    line_t *pool;           // Lines of the records (NULL while packed)
+    int p_len, p_cap;
+    unsigned char *data;    // NULL if the states are not packed (or spilled)
+    int size, raw;          // Compressed and uncompressed size
+    char spilled;           // The data is in the history log...
+    long long offset;       // ...at this position
+}block_t;
+
+// Implicit treap node holding a run of consecutive lines
+typedef struct node{
+    struct node *left, *right;
+    unsigned int priority;
+    int refs;   // Trees (versions) sharing this node
+    int count;  // Lines in the whole subtree
+    int fill;   // Lines in this node
+    line_t lines[LEAF_SIZE];
+}node_t;
+
 typedef struct state{
-    edit_t *undo, *redo;
+    int edit;           // Record in the log of the state's block (-1 if none)
+    long long mark;     // Arena position before this state stored its lines
+    long long work;     // Estimated cost of replaying the edits from state 0 up to here
+    long long bytes;    // Memory taken by the records and lines of the states up to here
+    int stamp;          // Creation order (indices get reused, stamps don't)
+#if PERSISTENT_TREE
+    node_t *version;    // Text as it was in this state
+#endif
 }state_t;
 
+// States discarded by an edit in the past that are still being freed: the
+// stamps they were created with and the arena positions of their lines
+typedef struct discard{
+    int from, to;
+    long long mark, top;
+}discard_t;
+
+// Run of consecutive lines taken from one of the piece table buffers
+typedef struct piece{
+    char source;    // ORIGINAL, ADDED or BLANK (lines not written yet)
+    int start, length;
+}piece_t;
+
+// SNAPSHOT_PAGE lines copied out of the text, shared by the snapshots that
+// hold the same lines
+typedef struct page{
+    int refs;
+    line_t lines[];
+}page_t;
+
+// Frozen copy of the text that the store can go back to
+typedef struct snapshot{
+    int length;
+    page_t **pages;     // Copy of the lines in pages (stores that can't share)
+    int pg_len;         // # of pages covering the snapshot
+    node_t *version;    // Shared root (tree store)
+}snapshot_t;
+
+// Snapshot of the text as it was in a given state
+typedef struct checkpoint{
+    int state;
+    snapshot_t text;
+}checkpoint_t;
+
+// States left behind by an edit in the past, hanging from state fork of
+// branch parent (0 for the current branch). Forks count the folded states
+// too, so that folding doesn't have to renumber them.
+typedef struct branch{
+    int parent, fork;
+    state_t *states;    // NULL once switched back to (or killed)
+    int len;
+    int first, last;    // Branches hanging from this one, by fork
+    int prev, next;     // Siblings (same parent)
+}branch_t;
+
+// Lines of the text a delta leads to: kept from the text it starts from
+// (from >= 0) or taken in order from the delta's own lines (from < 0)
+typedef struct run{
+    int from, count;
+}run_t;
+
+// Net effect of going from a state to another
+typedef struct delta{
+    int length;         // Lines in the text it starts from
+    run_t *runs;
+    int r_len, r_cap;
+    line_t *lines;
+    int l_len, l_cap;
+}delta_t;
+
+// Deltas of stride 2^k, the j-th going from state j*2^k to (j+1)*2^k or back
+typedef struct lift{
+    delta_t **redo, **undo;
+    int cap;
+}lift_t;
+
+// Part of the history log holding spilled line bodies, mapped whole
+typedef struct segment{
+    char *map;
+    long long offset;       // Where it starts in the log
+    long long size, used;
+}segment_t;
+
+// Chunk being compacted, and where its bits start in the live/moved maps
+typedef struct region{
+    chunk_t *chunk;
+    long long bit;
+}region_t;
+
+// Text of a recently visited state
+typedef struct cached{
+    int state;
+    long long used;     // Last access (vc_clock)
+    snapshot_t text;
+}cached_t;
+
+/* ===================================================================== */
+/* Function declarations */
+
+int PlanCapacity(int capacity, int required, int minimum);
+void *ResizeBlock(void *data, int capacity, int new_capacity, size_t unit);
+void *FitCapacity(void *data, int *capacity, int required, int minimum, size_t unit);
+
+void *ArenaAlloc(int size);
+line_t StoreLine(char *line, int length);
+void ReleaseLines(long long mark);
+unsigned int HashLine(char *line, int length);
+line_t InternLine(char *line, int length);
+void DropLine(line_t line);
+line_t EntryLine(entry_t *e);
+#if COMPACT_LINES
+char *ArenaAddress(long long position);
+#endif
+char *LineBody(line_t *line);
+int LineLength(line_t *line);
+void ReleaseEditLines(int state);
+
+// Text store interface (locations are 1 based)
+int TextLength();
+void SetTextLength(int length);
+void GetLines(int from, int count, line_t *dest);
+void SetLines(int from, line_t *lines, int count);
+void InsertLines(int location, line_t *lines, int count);
+void RemoveLines(int from, int count);
+void TakeSnapshot(snapshot_t *s);
+void RestoreSnapshot(snapshot_t *s);
+void FreeSnapshot(snapshot_t *s);
+long long RestoreCost(snapshot_t *s);
+void TrackSnapshot(snapshot_t *s);
+void TouchLines(int from, int to);
+void ShareSnapshot(snapshot_t *s, snapshot_t *like);
+long long SnapshotBytes(snapshot_t *s, snapshot_t *like);
+void MarkNodes(node_t *n, int mark);
+long long UnsharedBytes(node_t *n);
+page_t *NewPage(int count);
+void DropPage(page_t *page);
+int PageLength(snapshot_t *s, int p);
+
+void AdjustTextCapacity(int required_lines);
+void SetTextCapacity(int capacity);
+
+unsigned int NextPriority();
+int NodeCount(node_t *n);
+void UpdateNode(node_t *n);
+node_t *NewNode(line_t *lines, int fill, unsigned int priority);
+void FreeTree(node_t *n);
+node_t *MergeTrees(node_t *a, node_t *b);
+void SplitTree(node_t *n, int k, node_t **a, node_t **b);
+node_t *JoinTrees(node_t *a, node_t *b);
+node_t *BuildTree(line_t *lines, int count);
+node_t *OwnNode(node_t *n);
+node_t *AppendRun(node_t *n, line_t *lines, int count);
+void ReadRange(node_t *n, int from, int count, line_t *dest);
+node_t *WriteRange(node_t *n, int from, int count, line_t *lines);
+void SaveVersion();
+void RestoreVersion(int state);
+
+void ReservePieces(int required);
+int AppendLines(line_t *lines, int count);
+int SplitPieces(int k);
+void InsertPiece(int index, char source, int start, int length);
+void CompactPieces();
+
+void MoveGap(int k);
+
+void UpdateHistory();
+void CloseState(int cost);
+void TrimHistory();
+void FoldHistory(int count);
+void FreeStateContent(int index);
+void DiscardStates();
+void ReclaimState(int index);
+void ReclaimHistory();
+void ReleaseDiscards();
+int Discarded(int stamp);
+
+void CompactArena(long long bound);
+void ScanRoots();
+void ScanLines(line_t *lines, int count);
+void ScanTree(node_t *n);
+void ScanSnapshot(snapshot_t *s);
+void ScanPacked(int b);
+void RelocateLine(line_t *line);
+char *LineSlot(line_t *line, int *size);
+region_t *FindRegion(char *p);
+int CompareRegions(const void *a, const void *b);
+void RelinkEntries();
+
+edit_t *GetStateEdit();
+void SetupEdit(edit_t *e, char code, int loc, int before, int after, int size);
+line_t *ExtendEdit(int count);
+void AddLineToEdit(edit_t *e, line_t *lineContent);
+line_t *EditLines(int state, edit_t *e);
+void CutLog(int state, int cut);
+void FreeBlock(int b);
+
+int EditCost(edit_t *e);
+void SaveCheckpoint(int written);
+void DropCheckpoints(int state);
+void ThinCheckpoints();
+void RecountCheckpoints();
+int NextCheckpoint(int state);
+void KillBranch(int id);
+
+delta_t *NewDelta(int length);
+void FreeDelta(delta_t *d);
+void AddRun(delta_t *d, int from, int count, line_t *lines);
+delta_t *StepDelta(int state, char which);
+delta_t *ComposeDeltas(delta_t *a, delta_t *b);
+delta_t *LiftedDelta(int k, int j, char which);
+void ApplyDelta(delta_t *d);
+int LiftLevel(int state, int steps);
+long long DeltaBytes(delta_t *d);
+void ForgetDelta(delta_t **slot);
+void DropDeltas(int state);
+void TrimDeltas();
+
+void SaveBranch(int fork);
+void OnBranch(int id);
+int *FirstChild(int parent);
+int *LastChild(int parent);
+void LinkBranch(int id);
+void UnlinkBranch(int id);
+
+void CacheVersion(long long replay);
+void EvictVersion(int index);
+void DropCachedVersions(int state);
+
+void OnQuit();
+void OnPrint(int from, int to);
+void OnChange(int from, int to);
+void OnDelete(int from, int to);
+void OnUndo(int steps);
+void OnRedo(int steps);
+
+int CompressBytes(unsigned char *src, int size, unsigned char *dest);
+void DecompressBytes(unsigned char *src, int size, unsigned char *dest);
+unsigned char *EmitSequence(unsigned char *out, unsigned char *literals, int l_len, int offset, int m_len);
+void PackBlock(int b);
+void UnpackBlock(int b);
+void CoolHistory();
+int BlockPacked(int b);
+void SpillBlock(int b);
+void SpillBodies(int b);
+int HasBody(line_t *line);
+segment_t *BodySpace(long long length);
+void RepackBlock(int b, unsigned char *buffer);
+unsigned char *MapBlock(int b, void **map, size_t *map_len);
+edit_t *StateEdit(int index);
+
+void LoadDocument(char *path);
+
+void QueueUndos(int amount);
+void QueueRedos(int amount);
+void RestoreEdits();
+
+void TryRestoreState();
+
+/* ===================================================================== */
+/* Globals */
+
+line_t *text;   // Text container (flat and gap store)
+int t_cap = 0;  // Text capacity (flat and gap store)
+int t_len = 0;  // Text length
+
+int g_start = 0;    // First slot of the gap (gap store)
+int g_len = 0;      // Size of the gap (gap store)
+
+node_t *root = NULL;    // Text container (tree store)
+
+piece_t *pieces = NULL; // Text container (piece table)
+int p_cap = 0;          // Piece capacity
+int p_len = 0;          // # of pieces
+line_t *original = NULL; // Lines the document started with
+line_t *added = NULL;   // Append only buffer of every line written since
+int a_cap = 0;          // Added buffer capacity
+int a_len = 0;          // Added buffer length
+
+line_t *scratch = NULL; // Line buffer for bulk reads (print)
+int s_cap = 0;          // Scratch capacity
+
+char *in_buf = NULL;    // Buffer for all things input
+size_t in_size = 0;     // Size of the buffer
+ssize_t in_len = 0;     // Length of the input line
+
+char status = 0;    // Program status (aka what action is being performed)
+
+chunk_t *arena = NULL;      // Chunk line bodies are being stored in
+long long arena_top = 0;    // Arena position of the next line body
+#if COMPACT_LINES
+chunk_t **chunks = NULL;    // Chunk holding each ARENA_CHUNK_SIZE of positions
+int ch_cap = 0;
+#endif
+
+entry_t **buckets = NULL;   // Interned lines by hash
+int b_cap = 0;              // # of buckets (power of 2)
+int entries = 0;            // # of interned lines
+long long saved_bytes = 0;  // Bytes not stored thanks to interning
+
+region_t *regions = NULL;   // Chunks being compacted, by address
+int rg_len = 0;             // # of chunks being compacted
+unsigned char *live = NULL; // Slots (8 byte units) of theirs still referenced...
+unsigned char *moved = NULL;// ...and those copied to the new chunk already
+chunk_t *gc_target = NULL;  // Chunk the live slots are copied to
+char gc_pass = 0;           // MARK_LIVE or MOVE_LIVE
+long long live_bytes = 0;   // Size of the live slots
+long long kept_bytes = 0;   // Size of the chunk the last compaction made
+
+state_t *history;       // Edit timeline
+int h_cap = 0;          // Allocated blocks
+int stateCount = 0;     // Max time
+int currentState = 0;   // Current time
+int stamps = 0;         // States created so far
+int reclaim_to = 0;     // Slots [stateCount, reclaim_to) hold discarded states still to free
+
+discard_t *discards = NULL; // Discarded stamp ranges, by increasing stamp
+int ds_cap = 0;             // Allocated ranges
+int ds_len = 0;             // # of ranges
+
+int actions_to_restore = 0; // Undo/Redo queue
+
+block_t *blocks = NULL;     // History logs, one every COLD_BLOCK_STATES states
+int bl_cap = 0;             // Allocated blocks
+int bl_len = 0;             // # of blocks in use
+int cool_from = 0;          // First block that may still need packing
+long long cold_raw = 0;     // Bytes of history records currently packed...
+long long cold_size = 0;    // ...and what they take compressed
+int spill_from = 0;         // First block that may still need spilling
+int log_fd = -1;            // History log (a deleted temporary file)
+long long log_size = 0;     // Bytes appended to the log
+segment_t *segments = NULL; // Parts of the log holding line bodies
+int sg_cap = 0;             // Allocated segments
+int sg_len = 0;             // # of segments (the last one is being filled)
+
+long long copied_bytes = 0; // Bytes moved around by buffer resizes
+int resizes = 0;            // # of buffer resizes
+
+snapshot_t base;            // Text of state 0 (empty unless a document was loaded)
+snapshot_t rightMost;       // Most recent copy of the whole text before any undos are performed
+int rm_state = 0;           // what state is it?
+snapshot_t *tracking = NULL;// Snapshot whose pages are copied lazily (flat and gap stores)
+
+checkpoint_t *checkpoints = NULL;   // Restore points, by increasing state
+int ck_cap = 0;                     // Allocated checkpoints
+int ck_len = 0;                     // # of checkpoints
+int ck_ratio = 1;                   // Work between checkpoints, in document lengths
+int ck_idle = 0;                    // Checkpoints taken since one was last used
+long long ck_written = 0;           // Lines written since the last checkpoint
+long long ck_bytes = 0;             // Memory held by the checkpoints' copies
+
+cached_t *cache = NULL;     // Versions left behind by undo/redo
+int vc_cap = 0;             // Allocated entries
+int vc_len = 0;             // # of cached versions
+long long vc_bytes = 0;     // Line handles held by the cached versions (at most)
+long long vc_clock = 0;     // Accesses so far
+int vc_hits = 0;            // Restores that started from a cached version...
+int vc_misses = 0;          // ...and those that didn't
+
+lift_t lifts[LIFT_LEVELS];  // Composed deltas by level
+long long lift_bytes = 0;   // Memory they hold
+
+branch_t *branches = NULL;  // Undo tree branches, branch n is branches[n-1]
+int br_cap = 0;             // Allocated branches
+int br_len = 0;             // # of branches ever made
+int br_first = 0;           // Branches hanging from the current one, by fork...
+int br_last = 0;            // ...up to this one
+int folded = 0;             // States folded into base so far
+
+/* ===================================================================== */
+/* Main */
+
+int main(int argc, char* argv[]){
+
+    // Init text
+#if TEXT_STORE == FLAT_STORE || TEXT_STORE == GAP_STORE
+    SetTextCapacity(TEXT_BLOCK_SIZE);
+#endif
+
+    // Init history (count = 1, current = 0)
+    UpdateHistory();
+
+    // Start from an existing document if one is given
+    if(argc > 1) LoadDocument(argv[1]);
+
+    int arg1, arg2;
+    while(status != QUIT){
+        // Get input
+        in_len = getline(&in_buf, &in_size, stdin);
+        
+        // Execute input
+        switch (status = in_buf[in_len - 2]){
+            case PRINT:
+                RestoreEdits();
+                sscanf(in_buf, "%d,%dp", &arg1, &arg2);
+                OnPrint(arg1, arg2);
+                break;
+            case CHANGE:
+                RestoreEdits(); 
+                sscanf(in_buf, "%d,%dc", &arg1, &arg2);
+                OnChange(arg1, arg2);
+                break;
+            case DELETE:
+                RestoreEdits();
+                sscanf(in_buf, "%d,%dd", &arg1, &arg2);
+                OnDelete(arg1, arg2);
+                break;
+            case UNDO:
+                sscanf(in_buf, "%du", &arg1);
+                QueueUndos(arg1);
+                break;
+            case REDO:
+                sscanf(in_buf, "%dr", &arg1);
+                QueueRedos(arg1);
+                break;
+#if UNDO_TREE
+            case BRANCH:
+                sscanf(in_buf, "%db", &arg1);
+                OnBranch(arg1);
+                break;
+#endif
+            case QUIT:
+                OnQuit();
+                break;
+        }
+        ReclaimHistory();
+    }
+    return 0;
+}
+
+/* ===================================================================== */
+/* Capacity support */
+
+// Capacity for a buffer that must hold required items: grows geometrically,
+// shrinks only once less than 1/SHRINK_RATIO is used (and then to half full)
+// so that a size oscillating around a boundary doesn't realloc every time
+int PlanCapacity(int capacity, int required, int minimum){
+    if(required > capacity) return max(max(required, 2 * capacity), minimum);
+    if(capacity > minimum && required < capacity / SHRINK_RATIO) return max(2 * required, minimum);
+    return capacity;
+}
+
+void *ResizeBlock(void *data, int capacity, int new_capacity, size_t unit){
+    resizes++;
+    copied_bytes += (long long)min(capacity, new_capacity) * unit;
+    return realloc(data, new_capacity * unit);
+}
+
+// Resize data (if needed) so that it fits required items
+void *FitCapacity(void *data, int *capacity, int required, int minimum, size_t unit){
+    int planned = PlanCapacity(*capacity, required, minimum);
+    if(planned != *capacity){
+        data = ResizeBlock(data, *capacity, planned, unit);
+        *capacity = planned;
+    }
+    return data;
+}
+
+/* ===================================================================== */
+/* Line support */
+
+// Bump allocate size bytes (8 byte aligned) from the arena
+void *ArenaAlloc(int size){
+    size = (size + 7) & ~7;
+    if(arena == NULL || arena->used + size > arena->size){
+        int chunk = max(ARENA_CHUNK_SIZE, size);
+        chunk_t *c = (chunk_t*)malloc(sizeof(chunk_t) + chunk);
+        c->prev = arena;
+        c->base = arena_top;
+        c->size = chunk;
+        c->used = 0;
+        c->sealed = 0;
+#if COMPACT_LINES
+        // Chunks start on a multiple of ARENA_CHUNK_SIZE, so that a position
+        // finds its chunk by index
+        c->base = (arena_top + ARENA_CHUNK_SIZE - 1) / ARENA_CHUNK_SIZE * ARENA_CHUNK_SIZE;
+        // Positions are never reused (even the ones a compaction freed):
+        // past ARENA_LIMIT the handles would wrap around
+        if(c->base + chunk > ARENA_LIMIT){
+            fprintf(stderr, "line arena: out of positions for compact handles\n");
+            exit(1);
+        }
+        int first = c->base / ARENA_CHUNK_SIZE, last = (c->base + chunk - 1) / ARENA_CHUNK_SIZE;
+        chunks = (chunk_t**)FitCapacity(chunks, &ch_cap, last + 1, TEXT_BLOCK_SIZE, sizeof(chunk_t*));
+        for(int i = first; i <= last; i++) chunks[i] = c;
+#endif
+        arena = c;
+    }
+
+    void *block = arena->data + arena->used;
+    arena->used += size;
+    arena_top = arena->base + arena->used;
+    return block;
+}
+
+// Copy a line into the arena (terminated) and get its handle
+line_t StoreLine(char *line, int length){
+#if COMPACT_LINES
+    int *header = (int*)ArenaAlloc(sizeof(int) + length + 1);
+    *header = length;
+    char *body = (char*)(header + 1);
+#else
+    char *body = (char*)ArenaAlloc(length + 1);
+#endif
+    memcpy(body, line, length);
+    body[length] = '\0';
+#if COMPACT_LINES
+    return (line_t){.ref = (arena->base + (body - arena->data)) >> 2};
+#else
+    return (line_t){.body = body, .length = length};
+#endif
+}
+
+// Drop every line stored after arena position mark. States store their lines
+// in order, so this frees the lines of all the states created after the mark.
+void ReleaseLines(long long mark){
+    while(arena != NULL && arena->base >= mark && !arena->sealed){
+        chunk_t *prev = arena->prev;
+        free(arena);
+        arena = prev;
+    }
+    // (mark may fall in a chunk ReleaseDiscards already freed, a sealed one
+    // is full and stays as it is)
+    if(arena != NULL && arena->sealed) mark = max(mark, arena->base + arena->used);
+    else if(arena != NULL) arena->used = (int)min(mark - arena->base, arena->size);
+    arena_top = mark;
+}
+
+// FNV-1a
+unsigned int HashLine(char *line, int length){
+    unsigned int hash = 2166136261u;
+    for(int i = 0; i < length; i++){
+        hash ^= (unsigned char)line[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Get the handle of a line: short lines are copied in the handle, longer
+// ones get the shared copy (stored now if it's the first one)
+line_t InternLine(char *line, int length){
+#if INLINE_LINES
+    if(length <= INLINE_SIZE){
+        line_t small = {0};
+        memcpy(small.data, line, length);
+        small.tag = INLINE | length;
+        return small;
+    }
+#elif COMPACT_LINES && INTERN_LINES
+    // Short lines take less stored again than with a table entry
+    if(length <= INLINE_SIZE) return StoreLine(line, length);
+#endif
+
+#if INTERN_LINES
+    unsigned int hash = HashLine(line, length);
+
+    if(b_cap > 0){
+        for(entry_t *e = buckets[hash & (b_cap - 1)]; e != NULL; e = e->next){
+            if(e->hash == hash && e->length == length && memcmp(e->body, line, length) == 0 && !Discarded(e->stamp)){
+                e->refs++;
+                saved_bytes += length + 1;
+                return EntryLine(e);
+            }
+        }
+    }
+
+    // Keep about one entry per bucket
+    if(entries >= b_cap){
+        int capacity = max(2 * b_cap, INTERN_BLOCK_SIZE);
+        entry_t **rehashed = (entry_t**)calloc(capacity, sizeof(entry_t*));
+        for(int i = 0; i < b_cap; i++){
+            entry_t *e = buckets[i];
+            while(e != NULL){
+                entry_t *next = e->next;
+                e->next = rehashed[e->hash & (capacity - 1)];
+                rehashed[e->hash & (capacity - 1)] = e;
+                e = next;
+            }
+        }
+        free(buckets);
+        buckets = rehashed;
+        b_cap = capacity;
+    }
+
+    entry_t *e = (entry_t*)ArenaAlloc(sizeof(entry_t) + length + 1);
+    e->hash = hash;
+    e->refs = 1;
+    e->length = length;
+    e->stamp = stamps - 1;
+    memcpy(e->body, line, length);
+    e->body[length] = '\0';
+#if COMPACT_LINES
+    e->line.ref = (arena->base + (e->body - arena->data)) >> 2;
+#endif
+    e->next = buckets[hash & (b_cap - 1)];
+    buckets[hash & (b_cap - 1)] = e;
+    entries++;
+    return EntryLine(e);
+#else
+    return StoreLine(line, length);
+#endif
+}
+
+// A state that wrote this line is gone. The body itself is freed together
+// with the state's arena block, here it just leaves the table.
+void DropLine(line_t line){
+#if INTERN_LINES
+#if INLINE_LINES
+    if(line.tag) return;
+#elif COMPACT_LINES
+    if(LineLength(&line) <= INLINE_SIZE) return;
+#endif
+    entry_t *e = (entry_t*)(LineBody(&line) - offsetof(entry_t, body));
+    if(--e->refs > 0){
+        saved_bytes -= e->length + 1;
+        return;
+    }
+
+    entry_t **link = &buckets[e->hash & (b_cap - 1)];
+    while(*link != e) link = &(*link)->next;
+    *link = e->next;
+    entries--;
+#endif
+}
+
+line_t EntryLine(entry_t *e){
+#if COMPACT_LINES
+    return e->line;
+#else
+    return (line_t){.body = e->body, .length = e->length};
+#endif
+}
+
+#if COMPACT_LINES
+// Memory at an arena position (of a chunk still allocated)
+char *ArenaAddress(long long position){
+    chunk_t *c = chunks[position / ARENA_CHUNK_SIZE];
+    return c->data + (position - c->base);
+}
+#endif
+
+char *LineBody(line_t *line){
+#if COMPACT_LINES
+    return line->ref == 0 ? NULL : ArenaAddress((long long)line->ref << 2);
+#else
+#if INLINE_LINES
+    if(line->tag) return line->data;
+#endif
+    return line->body;
+#endif
+}
+
+int LineLength(line_t *line){
+#if COMPACT_LINES
+    return line->ref == 0 ? 0 : ((int*)LineBody(line))[-1];
+#else
+#if INLINE_LINES
+    if(line->tag) return line->tag & ~INLINE;
+#endif
+    return line->length;
+#endif
+}
+
+// Drop the lines written by the edit that made a state being discarded
+void ReleaseEditLines(int state){
+    if(history[state].edit < 0) return;
+    edit_t *e = StateEdit(state);
+    line_t *lines = EditLines(state, e) + e->taken;
+    for(int i = 0; i < e->fill; i++) DropLine(lines[i]);
+}
+
+/* ===================================================================== */
+/* Text support */
+
+int TextLength(){
+    return t_len;
+}
+
+#if TEXT_STORE == TREE_STORE
+
+// The tree is copy on write, a snapshot just shares the current root
+void TakeSnapshot(snapshot_t *s){
+    FreeTree(s->version);
+    if(root != NULL) root->refs++;
+    s->version = root;
+    s->length = t_len;
+}
+
+void RestoreSnapshot(snapshot_t *s){
+    if(s->version != NULL) s->version->refs++;
+    FreeTree(root);
+    root = s->version;
+    t_len = s->length;
+}
+
+void FreeSnapshot(snapshot_t *s){
+    FreeTree(s->version);
+    s->version = NULL;
+    s->length = 0;
+}
+
+long long RestoreCost(snapshot_t *s){
+    return 1;
+}
+
+// Sharing nodes is all a snapshot ever does here
+void TrackSnapshot(snapshot_t *s){
+    TakeSnapshot(s);
+}
+
+void ShareSnapshot(snapshot_t *s, snapshot_t *like){
+    TakeSnapshot(s);
+}
+
+// Memory of the nodes of s that neither like nor the text share: edits
+// copy every node on the path they touch, so a snapshot ends up pinning
+// the old copy of each leaf written since. A shared node shares its whole
+// subtree, so the walk stops there.
+long long SnapshotBytes(snapshot_t *s, snapshot_t *like){
+    MarkNodes(root, 1);
+    if(like != NULL) MarkNodes(like->version, 1);
+    long long bytes = UnsharedBytes(s->version);
+    MarkNodes(root, 0);
+    if(like != NULL) MarkNodes(like->version, 0);
+    return bytes;
+}
+
+// Flip the refs of the nodes of a tree negative (mark) or back (they are
+// only read in between)
+void MarkNodes(node_t *n, int mark){
+    if(n == NULL || (n->refs < 0) == mark) return;
+    n->refs = -n->refs;
+    MarkNodes(n->left, mark);
+    MarkNodes(n->right, mark);
+}
+
+long long UnsharedBytes(node_t *n){
+    if(n == NULL || n->refs < 0) return 0;
+    return sizeof(node_t) + UnsharedBytes(n->left) + UnsharedBytes(n->right);
+}
+
+#else
+
+// Other stores copy the lines in pages of SNAPSHOT_PAGE, a snapshot taken
+// like another one shares the pages that didn't change in between
+
+int PageLength(snapshot_t *s, int p){
+    return min(SNAPSHOT_PAGE, s->length - p * SNAPSHOT_PAGE);
+}
+
+page_t *NewPage(int count){
+    page_t *page = (page_t*)malloc(sizeof(page_t) + count * sizeof(line_t));
+    page->refs = 1;
+    return page;
+}
+
+void DropPage(page_t *page){
+    if(page != NULL && --page->refs == 0) free(page);
+}
+
+void TakeSnapshot(snapshot_t *s){
+    ShareSnapshot(s, NULL);
+}
+
+// Copy the text, reusing the pages of like that hold the same lines
+void ShareSnapshot(snapshot_t *s, snapshot_t *like){
+    FreeSnapshot(s);
+    s->length = t_len;
+    s->pg_len = (t_len + SNAPSHOT_PAGE - 1) / SNAPSHOT_PAGE;
+    s->pages = (page_t**)malloc(s->pg_len * sizeof(page_t*));
+
+    scratch = (line_t*)FitCapacity(scratch, &s_cap, SNAPSHOT_PAGE, TEXT_BLOCK_SIZE, sizeof(line_t));
+    for(int p = 0; p < s->pg_len; p++){
+        int count = PageLength(s, p);
+        GetLines(p * SNAPSHOT_PAGE + 1, count, scratch);
+        if(like != NULL && p < like->pg_len && like->pages[p] != NULL && PageLength(like, p) == count &&
+           memcmp(like->pages[p]->lines, scratch, count * sizeof(line_t)) == 0){
+            s->pages[p] = like->pages[p];
+            s->pages[p]->refs++;
+            continue;
+        }
+        s->pages[p] = NewPage(count);
+        memcpy(s->pages[p]->lines, scratch, count * sizeof(line_t));
+    }
+}
+
+void RestoreSnapshot(snapshot_t *s){
+    // A tracked snapshot only has the pages that changed, and the text
+    // matches it again once they are written back
+    int tracked = (s == tracking);
+    if(tracked) tracking = NULL;
+
+    SetTextLength(s->length);
+    for(int p = 0; p < s->pg_len; p++){
+        if(s->pages[p] == NULL) continue;
+        SetLines(p * SNAPSHOT_PAGE + 1, s->pages[p]->lines, PageLength(s, p));
+        if(tracked){
+            DropPage(s->pages[p]);
+            s->pages[p] = NULL;
+        }
+    }
+
+    if(tracked) tracking = s;
+}
+
+void FreeSnapshot(snapshot_t *s){
+    if(tracking == s) tracking = NULL;
+    for(int p = 0; p < s->pg_len; p++) DropPage(s->pages[p]);
+    free(s->pages);
+    s->pages = NULL;
+    s->pg_len = 0;
+    s->length = 0;
+}
+
+// Memory of the pages of s that it doesn't share with like
+long long SnapshotBytes(snapshot_t *s, snapshot_t *like){
+    long long bytes = s->pg_len * sizeof(page_t*);
+    for(int p = 0; p < s->pg_len; p++){
+        if(s->pages[p] == NULL) continue;
+        if(like != NULL && p < like->pg_len && like->pages[p] == s->pages[p]) continue;
+        bytes += sizeof(page_t) + PageLength(s, p) * sizeof(line_t);
+    }
+    return bytes;
+}
+
+// Only the pages held get written back
+long long RestoreCost(snapshot_t *s){
+    long long cost = 1;
+    for(int p = 0; p < s->pg_len; p++){
+        if(s->pages[p] != NULL) cost += PageLength(s, p);
+    }
+    return cost;
+}
+
+#if TEXT_STORE == FLAT_STORE || TEXT_STORE == GAP_STORE
+
+// Arm a snapshot of the current text without copying it: the pages are
+// saved one by one right before they first change
+void TrackSnapshot(snapshot_t *s){
+    FreeSnapshot(s);
+    s->length = t_len;
+    s->pg_len = (t_len + SNAPSHOT_PAGE - 1) / SNAPSHOT_PAGE;
+    s->pages = (page_t**)calloc(s->pg_len, sizeof(page_t*));
+    tracking = s;
+}
+
+// Lines [from, to) (0 based) are about to change
+void TouchLines(int from, int to){
+    if(tracking == NULL) return;
+    to = min(to, tracking->length);
+    for(int p = from / SNAPSHOT_PAGE; p * SNAPSHOT_PAGE < to; p++){
+        if(tracking->pages[p] != NULL) continue;
+        int count = PageLength(tracking, p);
+        tracking->pages[p] = NewPage(count);
+        GetLines(p * SNAPSHOT_PAGE + 1, count, tracking->pages[p]->lines);
+    }
+}
+
+#else
+
+// The piece table has no cheap way to see writes coming, copy eagerly
+void TrackSnapshot(snapshot_t *s){
+    TakeSnapshot(s);
+}
+
+#endif
+
+#endif
+
+#if TEXT_STORE == TREE_STORE
+
+unsigned int NextPriority(){
+    // xorshift32, deterministic so runs are reproducible
+    static unsigned int seed = 2463534242u;
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+int NodeCount(node_t *n){
+    return n == NULL ? 0 : n->count;
+}
+
+void UpdateNode(node_t *n){
+    n->count = NodeCount(n->left) + n->fill + NodeCount(n->right);
+}
+
+node_t *NewNode(line_t *lines, int fill, unsigned int priority){
+    node_t *n = (node_t*)malloc(sizeof(node_t));
+    n->left = NULL;
+    n->right = NULL;
+    n->priority = priority;
+    n->refs = 1;
+    n->fill = fill;
+    n->count = fill;
+    if(lines != NULL) memcpy(n->lines, lines, fill * sizeof(line_t));
+    else memset(n->lines, 0, fill * sizeof(line_t));
+    return n;
+}
+
+// Drop a reference to the tree, freeing the nodes nobody else uses
+void FreeTree(node_t *n){
+    if(n == NULL || --n->refs > 0) return;
+    FreeTree(n->left);
+    FreeTree(n->right);
+    free(n);
+}
+
+// Get a node that is safe to modify, copying it if other versions share it.
+// Takes over the caller's reference to n.
+node_t *OwnNode(node_t *n){
+    if(n == NULL || n->refs == 1) return n;
+
+    node_t *copy = (node_t*)malloc(sizeof(node_t));
+    memcpy(copy, n, sizeof(node_t) - (LEAF_SIZE - n->fill) * sizeof(line_t));
+    copy->refs = 1;
+    if(copy->left != NULL) copy->left->refs++;
+    if(copy->right != NULL) copy->right->refs++;
+    n->refs--;
+    return copy;
+}
+
+node_t *MergeTrees(node_t *a, node_t *b){
+    if(a == NULL) return b;
+    if(b == NULL) return a;
+
+    if(a->priority > b->priority){
+        a = OwnNode(a);
+        a->right = MergeTrees(a->right, b);
+        UpdateNode(a);
+        return a;
+    }
+    b = OwnNode(b);
+    b->left = MergeTrees(a, b->left);
+    UpdateNode(b);
+    return b;
+}
+
+// Split n so that the first k lines end up in *a and the rest in *b
+void SplitTree(node_t *n, int k, node_t **a, node_t **b){
+    if(NodeCount(n) <= k || k <= 0){
+        *a = k <= 0 ? NULL : n;
+        *b = k <= 0 ? n : NULL;
+        return;
+    }
+
+    n = OwnNode(n);
+    int left = NodeCount(n->left);
+    if(k <= left){
+        SplitTree(n->left, k, a, &n->left);
+        UpdateNode(n);
+        *b = n;
+    }
+    else if(k >= left + n->fill){
+        SplitTree(n->right, k - left - n->fill, &n->right, b);
+        UpdateNode(n);
+        *a = n;
+    }
+    else {
+        // The cut falls inside this run: move the tail into a new node
+        // (same priority, so the heap order still holds where it lands)
+        int keep = k - left;
+        node_t *tail = NewNode(n->lines + keep, n->fill - keep, n->priority);
+        node_t *right = n->right;
+        n->fill = keep;
+        n->right = NULL;
+        UpdateNode(n);
+        *a = n;
+        *b = MergeTrees(tail, right);
+    }
+}
+
+// Append lines to the last run of the tree
+node_t *AppendRun(node_t *n, line_t *lines, int count){
+    n = OwnNode(n);
+    if(n->right != NULL) n->right = AppendRun(n->right, lines, count);
+    else {
+        memcpy(n->lines + n->fill, lines, count * sizeof(line_t));
+        n->fill += count;
+    }
+    UpdateNode(n);
+    return n;
+}
+
+// Merge two trees, packing the runs at the seam into one node when they fit
+node_t *JoinTrees(node_t *a, node_t *b){
+    if(a == NULL || b == NULL) return MergeTrees(a, b);
+
+    node_t *last = a;
+    while(last->right != NULL) last = last->right;
+    node_t *first = b;
+    while(first->left != NULL) first = first->left;
+
+    if(last->fill + first->fill <= LEAF_SIZE){
+        node_t *head;
+        SplitTree(b, first->fill, &head, &b);
+        a = AppendRun(a, head->lines, head->fill);
+        FreeTree(head);
+    }
+
+    return MergeTrees(a, b);
+}
+
+// Build a tree out of count lines (NULL lines if lines is NULL)
+node_t *BuildTree(line_t *lines, int count){
+    node_t *t = NULL;
+    for(int i = 0; i < count; i += LEAF_SIZE){
+        int fill = min(LEAF_SIZE, count - i);
+        t = MergeTrees(t, NewNode(lines != NULL ? lines + i : NULL, fill, NextPriority()));
+    }
+    return t;
+}
+
+// Copy count lines starting at (0 based) from out of the subtree
+void ReadRange(node_t *n, int from, int count, line_t *dest){
+    if(n == NULL || count <= 0) return;
+
+    int left = NodeCount(n->left);
+    int done = 0;
+
+    // Lines in the left subtree
+    if(from < left){
+        done = min(count, left - from);
+        ReadRange(n->left, from, done, dest);
+    }
+
+    // Lines in this node
+    int pos = from + done;
+    if(done < count && pos < left + n->fill){
+        int run = min(count - done, left + n->fill - pos);
+        memcpy(dest + done, n->lines + (pos - left), run * sizeof(line_t));
+        done += run;
+        pos += run;
+    }
+
+    // Lines in the right subtree
+    if(done < count)
+        ReadRange(n->right, pos - left - n->fill, count - done, dest + done);
+}
+
+// Overwrite count lines starting at (0 based) from, returns the new subtree
+node_t *WriteRange(node_t *n, int from, int count, line_t *lines){
+    if(n == NULL || count <= 0) return n;
+
+    n = OwnNode(n);
+    int left = NodeCount(n->left);
+    int done = 0;
+
+    if(from < left){
+        done = min(count, left - from);
+        n->left = WriteRange(n->left, from, done, lines);
+    }
+
+    int pos = from + done;
+    if(done < count && pos < left + n->fill){
+        int run = min(count - done, left + n->fill - pos);
+        memcpy(n->lines + (pos - left), lines + done, run * sizeof(line_t));
+        done += run;
+        pos += run;
+    }
+
+    if(done < count)
+        n->right = WriteRange(n->right, pos - left - n->fill, count - done, lines + done);
+    return n;
+}
+
+void SetTextLength(int length){
+    if(length < t_len){
+        node_t *rest;
+        SplitTree(root, length, &root, &rest);
+        FreeTree(rest);
+    }
+    else if(length > t_len){
+        root = JoinTrees(root, BuildTree(NULL, length - t_len));
+    }
+    t_len = length;
+}
+
+void GetLines(int from, int count, line_t *dest){
+    ReadRange(root, from - 1, count, dest);
+}
+
+void SetLines(int from, line_t *lines, int count){
+    root = WriteRange(root, from - 1, count, lines);
+}
+
+void InsertLines(int location, line_t *lines, int count){
+    node_t *a, *b;
+    SplitTree(root, location - 1, &a, &b);
+    root = JoinTrees(JoinTrees(a, BuildTree(lines, count)), b);
+    t_len += count;
+}
+
+void RemoveLines(int from, int count){
+    node_t *a, *mid, *b;
+    SplitTree(root, from - 1, &a, &b);
+    SplitTree(b, count, &mid, &b);
+    FreeTree(mid);
+    root = JoinTrees(a, b);
+    t_len -= count;
+}
+
+#if PERSISTENT_TREE
+
+// Let the current state keep a reference to the text as it is now
+void SaveVersion(){
+    if(root != NULL) root->refs++;
+    history[currentState].version = root;
+}
+
+// Switch the text to the version kept by another state
+void RestoreVersion(int state){
+    FreeTree(root);
+    root = history[state].version;
+    if(root != NULL) root->refs++;
+    t_len = NodeCount(root);
+    currentState = state;
+}
+
+#endif
+
+#elif TEXT_STORE == PIECE_STORE
+
+void ReservePieces(int required){
+    pieces = (piece_t*)FitCapacity(pieces, &p_cap, required, TEXT_BLOCK_SIZE, sizeof(piece_t));
+}
+
+// Append lines to the added buffer, returns where they start
+int AppendLines(line_t *lines, int count){
+    added = (line_t*)FitCapacity(added, &a_cap, a_len + count, TEXT_BLOCK_SIZE, sizeof(line_t));
+    memcpy(added + a_len, lines, count * sizeof(line_t));
+    a_len += count;
+    return a_len - count;
+}
+
+// Make sure a piece starts right at (0 based) line k, returns its index
+int SplitPieces(int k){
+    int i = 0, line = 0;
+    while(i < p_len && line + pieces[i].length <= k){
+        line += pieces[i].length;
+        i++;
+    }
+    if(i == p_len || line == k) return i;
+
+    // Cut piece i in two
+    int cut = k - line;
+    ReservePieces(p_len + 1);
+    memmove(pieces + i + 1, pieces + i, (p_len - i) * sizeof(piece_t));
+    p_len++;
+    pieces[i].length = cut;
+    pieces[i+1].start += cut;
+    pieces[i+1].length -= cut;
+    return i + 1;
+}
+
+void InsertPiece(int index, char source, int start, int length){
+    piece_t *prev = index > 0 ? &pieces[index-1] : NULL;
+
+    // Extend the previous piece if the new run follows it in the same buffer
+    if(prev != NULL && prev->source == source && (source == BLANK || prev->start + prev->length == start)){
+        prev->length += length;
+        return;
+    }
+
+    ReservePieces(p_len + 1);
+    memmove(pieces + index + 1, pieces + index, (p_len - index) * sizeof(piece_t));
+    p_len++;
+    pieces[index].source = source;
+    pieces[index].start = start;
+    pieces[index].length = length;
+}
+
+// Rewrite the document as a single piece once lookups (too many pieces) or
+// memory (dead lines in the added buffer) get too expensive
+void CompactPieces(){
+    if((long long)p_len * p_len <= 4LL * t_len + PIECE_SLACK && a_len <= 2 * t_len + PIECE_SLACK) return;
+
+    int c_cap = 0;
+    line_t *compact = (line_t*)FitCapacity(NULL, &c_cap, t_len, TEXT_BLOCK_SIZE, sizeof(line_t));
+    GetLines(1, t_len, compact);
+    free(added);
+    added = compact;
+    a_cap = c_cap;
+    a_len = t_len;
+
+    p_len = 0;
+    if(t_len > 0) InsertPiece(0, ADDED, 0, t_len);
+}
+
+void SetTextLength(int length){
+    if(length < t_len) RemoveLines(length + 1, t_len - length);
+    else if(length > t_len){
+        InsertPiece(p_len, BLANK, 0, length - t_len);
+        t_len = length;
+    }
+}
+
+void GetLines(int from, int count, line_t *dest){
+    if(count == 0) return;
+
+    int i = 0, line = 0, k = from - 1;
+    while(line + pieces[i].length <= k){
+        line += pieces[i].length;
+        i++;
+    }
+
+    int offset = k - line;
+    while(count > 0){
+        int run = min(count, pieces[i].length - offset);
+        switch(pieces[i].source){
+            case ORIGINAL: memcpy(dest, original + pieces[i].start + offset, run * sizeof(line_t)); break;
+            case ADDED: memcpy(dest, added + pieces[i].start + offset, run * sizeof(line_t)); break;
+            default: memset(dest, 0, run * sizeof(line_t)); break;
+        }
+        dest += run;
+        count -= run;
+        offset = 0;
+        i++;
+    }
+}
+
+void SetLines(int from, line_t *lines, int count){
+    if(count == 0) return;
+    RemoveLines(from, count);
+    InsertLines(from, lines, count);
+}
+
+void InsertLines(int location, line_t *lines, int count){
+    if(count == 0) return;
+    int start = AppendLines(lines, count);
+    InsertPiece(SplitPieces(location - 1), ADDED, start, count);
+    t_len += count;
+    CompactPieces();
+}
+
+void RemoveLines(int from, int count){
+    if(count == 0) return;
+    int first = SplitPieces(from - 1);
+    int last = SplitPieces(from - 1 + count);
+    memmove(pieces + first, pieces + last, (p_len - last) * sizeof(piece_t));
+    p_len -= last - first;
+    t_len -= count;
+
+    // Glue the pieces around the hole back together when possible
+    if(first > 0 && first < p_len){
+        piece_t next = pieces[first];
+        memmove(pieces + first, pieces + first + 1, (p_len - first - 1) * sizeof(piece_t));
+        p_len--;
+        InsertPiece(first, next.source, next.start, next.length);
+    }
+}
+
+#else
+
+void SetTextCapacity(int capacity){
+#if TEXT_STORE == GAP_STORE
+    // Keep the lines after the gap at the end of the buffer
+    int tail = t_len - g_start;
+    if(capacity < t_cap) memmove(text + capacity - tail, text + g_start + g_len, tail * sizeof(line_t));
+    text = (line_t*)ResizeBlock(text, t_cap, capacity, sizeof(line_t));
+    if(capacity > t_cap) memmove(text + capacity - tail, text + g_start + g_len, tail * sizeof(line_t));
+    g_len = capacity - t_len;
+#else
+    text = (line_t*)ResizeBlock(text, t_cap, capacity, sizeof(line_t));
+#endif
+    t_cap = capacity;
+}
+
+void AdjustTextCapacity(int required_lines)
+{
+#if TEXT_STORE == GAP_STORE
+    // Always leave room for a gap of GAP_SIZE lines
+    required_lines += GAP_SIZE;
+#endif
+
+    int capacity = PlanCapacity(t_cap, required_lines, TEXT_BLOCK_SIZE);
+    if(capacity != t_cap) SetTextCapacity(capacity);
+}
+
+#if TEXT_STORE == GAP_STORE
+
+// Move the gap so that it starts right after (0 based) line k
+void MoveGap(int k){
+    if(k < g_start) memmove(text + k + g_len, text + k, (g_start - k) * sizeof(line_t));
+    else if(k > g_start) memmove(text + g_start, text + g_start + g_len, (k - g_start) * sizeof(line_t));
+    g_start = k;
+}
+
+void SetTextLength(int length){
+    if(length < t_len) RemoveLines(length + 1, t_len - length);
+    else if(length > t_len){
+        TouchLines(t_len, length);
+        AdjustTextCapacity(length);
+        MoveGap(t_len);
+        memset(text + g_start, 0, (length - t_len) * sizeof(line_t));
+        g_start += length - t_len;
+        g_len -= length - t_len;
+        t_len = length;
+    }
+}
+
+void GetLines(int from, int count, line_t *dest){
+    int k = from - 1;
+    int before = max(0, min(count, g_start - k));
+    memcpy(dest, text + k, before * sizeof(line_t));
+    memcpy(dest + before, text + k + before + g_len, (count - before) * sizeof(line_t));
+}
+
+void SetLines(int from, line_t *lines, int count){
+    int k = from - 1;
+    TouchLines(k, k + count);
+    int before = max(0, min(count, g_start - k));
+    memcpy(text + k, lines, before * sizeof(line_t));
+    memcpy(text + k + before + g_len, lines + before, (count - before) * sizeof(line_t));
+}
+
+void InsertLines(int location, line_t *lines, int count){
+    TouchLines(location - 1, t_len + count);
+    AdjustTextCapacity(t_len + count);
+    MoveGap(location - 1);
+    memcpy(text + g_start, lines, count * sizeof(line_t));
+    g_start += count;
+    g_len -= count;
+    t_len += count;
+}
+
+void RemoveLines(int from, int count){
+    TouchLines(from - 1, t_len);
+    MoveGap(from - 1);
+    g_len += count;
+    t_len -= count;
+    AdjustTextCapacity(t_len);
+}
+
+#else
+
+void SetTextLength(int length){
+    TouchLines(min(length, t_len), max(length, t_len));
+    t_len = length;
+    AdjustTextCapacity(t_len);
+}
+
+void GetLines(int from, int count, line_t *dest){
+    memcpy(dest, text + from - 1, count * sizeof(line_t));
+}
+
+void SetLines(int from, line_t *lines, int count){
+    TouchLines(from - 1, from - 1 + count);
+    memcpy(text + from - 1, lines, count * sizeof(line_t));
+}
+
+void InsertLines(int location, line_t *lines, int count){
+    int tail = t_len - (location - 1);
+    TouchLines(location - 1, t_len + count);
+    SetTextLength(t_len + count);
+    memmove(text + location - 1 + count, text + location - 1, tail * sizeof(line_t));
+    memcpy(text + location - 1, lines, count * sizeof(line_t));
+}
+
+void RemoveLines(int from, int count){
+    int tail = t_len - (from - 1 + count);
+    TouchLines(from - 1, t_len);
+    memmove(text + from - 1, text + from - 1 + count, tail * sizeof(line_t));
+    SetTextLength(t_len - count);
+}
+
+#endif
+
+#endif
+
+/* ===================================================================== */
+/* Document loading */
+
+// Map the file and make its lines the text of state 0. Lines point straight
+// into the mapping: edits replace handles, so they are never copied (but
+// for compact handles, which only reach the arena).
+void LoadDocument(char *path){
+    int fd = open(path, O_RDONLY);
+    if(fd < 0){
+        perror(path);
+        exit(1);
+    }
+
+    struct stat info;
+    fstat(fd, &info);
+    if(info.st_size == 0){
+        close(fd);
+        return;
+    }
+
+    char *map = (char*)mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED){
+        perror(path);
+        exit(1);
+    }
+
+    // Index the lines
+    line_t *lines = NULL;
+    int l_cap = 0, count = 0;
+    char *cursor = map, *end = map + info.st_size;
+    while(cursor < end){
+        char *newline = (char*)memchr(cursor, '\n', end - cursor);
+        lines = (line_t*)FitCapacity(lines, &l_cap, count + 1, TEXT_BLOCK_SIZE, sizeof(line_t));
+        if(newline != NULL){
+#if COMPACT_LINES
+            // Handles can't point into the mapping: copy the line
+            lines[count] = InternLine(cursor, newline - cursor + 1);
+#else
+            lines[count] = (line_t){.body = cursor, .length = newline - cursor + 1};
+#endif
+            cursor = newline + 1;
+        }
+        else {
+            // The last line has no terminator: that one gets a copy with it
+            int length = end - cursor;
+            char *copy = (char*)malloc(length + 2);
+            memcpy(copy, cursor, length);
+            copy[length] = '\n';
+            copy[length + 1] = '\0';
+            lines[count] = InternLine(copy, length + 1);
+            free(copy);
+            cursor = end;
+        }
+        count++;
+    }
+#if COMPACT_LINES
+    munmap(map, info.st_size);
+#endif
+
+#if TEXT_STORE == PIECE_STORE
+    // The index is the piece table's original buffer
+    original = lines;
+    InsertPiece(0, ORIGINAL, 0, count);
+    t_len = count;
+#else
+    InsertLines(1, lines, count);
+    free(lines);
+#endif
+
+    TakeSnapshot(&base);
+#if PERSISTENT_TREE
+    SaveVersion();
+#endif
+}
+
+/* ===================================================================== */
+/* History support */
+
+void UpdateHistory(){
+
+    // A new edit leaves the rightMost state behind for good
+    FreeSnapshot(&rightMost);
+    rm_state = 0;
+
+    // Making changes in the present
+    if(stateCount == 0 || currentState == stateCount-1){
+        // Entering a block that still holds discarded states: free them all,
+        // the new records go to a fresh log
+        if(stateCount % COLD_BLOCK_STATES == 0){
+            for(int i = min(stateCount + COLD_BLOCK_STATES, reclaim_to) - 1; i >= stateCount; i--) ReclaimState(i);
+        }
+        // Increase count by one state and reallocate memory
+        stateCount++;
+    }
+    // Making changes in the past
+    else {
+#if UNDO_TREE
+        SaveBranch(currentState);
+#else
+        DiscardStates();
+#endif
+        DropCheckpoints(currentState);
+        DropDeltas(currentState);
+        DropCachedVersions(currentState);
+        // Set new size and reallocate
+        stateCount = currentState + 2;
+    }
+
+    // Resize history space (discarded states still to free keep their slots)
+    history = (state_t*)FitCapacity(history, &h_cap, max(stateCount, reclaim_to), EDIT_BLOCK_SIZE, sizeof(state_t));
+
+    // Initialize new state
+    history[stateCount - 1].edit = -1;
+    history[stateCount - 1].mark = arena_top;
+    history[stateCount - 1].work = 0;
+    history[stateCount - 1].bytes = 0;
+    history[stateCount - 1].stamp = stamps++;
+#if PERSISTENT_TREE
+    history[stateCount - 1].version = NULL;
+#endif
+
+#if COLD_HISTORY
+    CoolHistory();
+#endif
+}
+
+// Bookkeeping for the state an edit just created (cost is its EditCost)
+void CloseState(int cost){
+    edit_t *e = StateEdit(currentState);
+    long long bytes = sizeof(edit_t) + (long long)(e->taken + e->fill) * sizeof(line_t) + arena_top - history[currentState].mark;
+    history[currentState].work = history[currentState - 1].work + cost;
+    history[currentState].bytes = history[currentState - 1].bytes + bytes;
+
+    SaveCheckpoint(1 + e->size);
+    TrimHistory();
+}
+
+// Fold whole runs of FOLD_STATES of the oldest states while the history
+// is over budget (the current one is the newest, edits only come there)
+void TrimHistory(){
+#if HISTORY_DEPTH || HISTORY_BYTES
+    int count = 0;
+    while(count + FOLD_STATES <= currentState){
+        int over = 0;
+        if(HISTORY_DEPTH > 0 && currentState - count - FOLD_STATES >= HISTORY_DEPTH) over = 1;
+        if(HISTORY_BYTES > 0 && history[currentState].bytes - history[count].bytes > HISTORY_BYTES) over = 1;
+        if(!over) break;
+        count += FOLD_STATES;
+    }
+    if(count > 0) FoldHistory(count);
+#endif
+}
+
+// Make state count the new state 0: base takes its text and the logs of
+// the blocks before it are freed, then the arena gives back the bodies
+// nothing points to anymore
+void FoldHistory(int count){
+    // Visit the new oldest state to snapshot it, then come back
+    int here = currentState;
+    TrackSnapshot(&rightMost);
+    rm_state = here;
+    actions_to_restore = count - here;
+    RestoreEdits();
+    TakeSnapshot(&base);
+    RestoreSnapshot(&rightMost);
+    currentState = here;
+
+#if INTERN_LINES
+    // The folded states no longer hold the lines they wrote
+    for(int i = 1; i <= count; i++) ReleaseEditLines(i);
+#endif
+
+    // Whole blocks go (count is a multiple of COLD_BLOCK_STATES)
+    int gone = count / COLD_BLOCK_STATES;
+    for(int b = 0; b < gone; b++) FreeBlock(b);
+    memmove(blocks, blocks + gone, (bl_len - gone) * sizeof(block_t));
+    bl_len -= gone;
+    cool_from = max(cool_from - gone, 0);
+    spill_from = max(spill_from - gone, 0);
+
+#if PERSISTENT_TREE
+    for(int i = 0; i < count; i++) FreeTree(history[i].version);
+#endif
+    history[count].edit = -1;
+
+    // Renumber what is left (the strides don't line up anymore)
+    DropDeltas(-1);
+    stateCount -= count;
+    currentState -= count;
+    rm_state -= count;
+    reclaim_to = max(reclaim_to - count, 0);
+    long long work = history[count].work, bytes = history[count].bytes;
+    memmove(history, history + count, max(stateCount, reclaim_to) * sizeof(state_t));
+    for(int i = 0; i < stateCount; i++){
+        history[i].work -= work;
+        history[i].bytes -= bytes;
+    }
+    history = (state_t*)FitCapacity(history, &h_cap, max(stateCount, reclaim_to), EDIT_BLOCK_SIZE, sizeof(state_t));
+
+    int kept = 0;
+    for(int i = 0; i < ck_len; i++){
+        if(checkpoints[i].state <= count) FreeSnapshot(&checkpoints[i].text);
+        else {
+            checkpoints[kept] = checkpoints[i];
+            checkpoints[kept++].state -= count;
+        }
+    }
+    ck_len = kept;
+    RecountCheckpoints();
+
+    for(int i = vc_len - 1; i >= 0; i--){
+        if(cache[i].state <= count) EvictVersion(i);
+    }
+    for(int i = 0; i < vc_len; i++) cache[i].state -= count;
+
+    // Branches hanging from a folded state can't be reached anymore (they
+    // come first, the current branch's are by fork)
+    while(br_first != 0 && branches[br_first - 1].fork - folded < count) KillBranch(br_first);
+    folded += count;
+
+    // Only the states left store lines past the mark of the first one
+    CompactArena(history[1].mark);
+}
+
+// Let go of a discarded state (its records go with the log of its block)
+void FreeStateContent(int index){
+
+    ReleaseEditLines(index);
+    history[index].edit = -1;
+
+#if PERSISTENT_TREE
+    FreeTree(history[index].version);
+    history[index].version = NULL;
+#endif
+}
+
+// Drop the states after the current one, an edit is coming. A few of them
+// (and nothing else pending) are freed now, the rest is only detached:
+// their slots wait past stateCount for ReclaimHistory, and the lines they
+// interned are skipped by InternLine until then.
+void DiscardStates(){
+    int first = currentState + 1;
+    int next = first / COLD_BLOCK_STATES + 1;
+    // The records after that of the first of them are all of the others
+    int cut = history[first].edit;
+
+    if(RECLAIM_STATES == 0 || (ds_len == 0 && stateCount - first <= RECLAIM_STATES)){
+        for(int i = stateCount - 1; i >= first; i--) ReclaimState(i);
+        ReleaseLines(history[first].mark);
+        for(int b = next; b < bl_len; b++) FreeBlock(b);
+        bl_len = min(bl_len, next);
+    }
+    else {
+        // Older ranges from a later stamp are part of this one
+        int from = history[first].stamp;
+        while(ds_len > 0 && discards[ds_len - 1].from >= from) ds_len--;
+        discards = (discard_t*)FitCapacity(discards, &ds_cap, ds_len + 1, EDIT_BLOCK_SIZE, sizeof(discard_t));
+        discards[ds_len++] = (discard_t){.from = from, .to = stamps, .mark = history[first].mark, .top = arena_top};
+
+        // The rest of the block the new state goes in is freed now, the
+        // blocks after it are left for later
+        for(int i = min(next * COLD_BLOCK_STATES, stateCount) - 1; i >= first; i--) ReclaimState(i);
+        reclaim_to = max(reclaim_to, stateCount);
+    }
+    CutLog(first, cut);
+}
+
+// Free the records of the state in slot index, unpacking them first if
+// needed. Discarding the first state of a block frees its log (the states
+// after it in the block are gone already).
+void ReclaimState(int index){
+    int b = index / COLD_BLOCK_STATES;
+#if COLD_HISTORY
+    if(BlockPacked(b)) UnpackBlock(b);
+#endif
+    FreeStateContent(index);
+    if(index % COLD_BLOCK_STATES == 0 && index >= stateCount){
+        FreeBlock(b);
+        if(b == bl_len - 1) bl_len--;
+    }
+}
+
+// Free up to RECLAIM_STATES of the discarded states, the last ones first
+void ReclaimHistory(){
+    int stop = max(stateCount, reclaim_to - RECLAIM_STATES);
+    while(reclaim_to > stop) ReclaimState(--reclaim_to);
+    if(ds_len > 0 && reclaim_to <= stateCount) ReleaseDiscards();
+}
+
+// Every discarded record is gone, and so are the table entries of the
+// lines they interned: free the chunks holding nothing but their lines.
+// The partly discarded ones go when the arena is rewound past them.
+void ReleaseDiscards(){
+    for(int i = 0; i < ds_len; i++){
+        chunk_t **link = &arena;
+        while(*link != NULL && (*link)->base >= discards[i].mark){
+            chunk_t *c = *link;
+            if(c != arena && !c->sealed && c->base + c->used <= discards[i].top){
+                *link = c->prev;
+                free(c);
+            }
+            else link = &c->prev;
+        }
+    }
+    ds_len = 0;
+}
+
+// Whether the state with this stamp was discarded (and is still being freed)
+int Discarded(int stamp){
+    for(int i = 0; i < ds_len; i++){
+        if(discards[i].from <= stamp && stamp < discards[i].to) return 1;
+    }
+    return 0;
+}
+
+/* ===================================================================== */
+/* Arena compaction */
+
+// Move the bodies still referenced from the chunks wholly below arena
+// position bound into one sealed chunk that takes their place, once they
+// hold more than kept_bytes (and ARENA_CHUNK_SIZE) of anything else. Two
+// passes visit every line handle: the first marks the live slots and adds
+// up their size, the second copies each one on first sight (leaving its
+// offset in the new chunk in the old body) and points the handles there.
+void CompactArena(long long bound){
+    // The chunks to compact are the oldest ones, never the one being filled
+    chunk_t *above = NULL, *c = arena;
+    while(c != NULL && (c == arena || c->base + c->used > bound)){
+        above = c;
+        c = c->prev;
+    }
+    long long used = 0;
+    rg_len = 0;
+    for(chunk_t *r = c; r != NULL; r = r->prev){
+        used += r->used;
+        rg_len++;
+    }
+    if(rg_len == 0 || used - kept_bytes < max(kept_bytes, ARENA_CHUNK_SIZE)) return;
+
+    regions = (region_t*)malloc(rg_len * sizeof(region_t));
+    long long bits = 0, lo = 0;
+    int i = 0;
+    for(chunk_t *r = c; r != NULL; r = r->prev){
+        regions[i].chunk = r;
+        regions[i++].bit = bits;
+        bits += r->used / 8;
+        lo = r->base;
+    }
+    qsort(regions, rg_len, sizeof(region_t), CompareRegions);
+    live = (unsigned char*)calloc(bits / 8 + 1, 1);
+    moved = (unsigned char*)calloc(bits / 8 + 1, 1);
+
+    gc_pass = MARK_LIVE;
+    live_bytes = 0;
+    ScanRoots();
+
+    gc_target = (chunk_t*)malloc(sizeof(chunk_t) + live_bytes);
+    gc_target->prev = NULL;
+    gc_target->base = lo;
+    gc_target->size = (int)live_bytes;
+    gc_target->used = 0;
+    gc_target->sealed = 1;
+
+    gc_pass = MOVE_LIVE;
+    ScanRoots();
+    RelinkEntries();
+
+    while(c != NULL){
+        chunk_t *prev = c->prev;
+        free(c);
+        c = prev;
+    }
+    if(live_bytes > 0){
+        above->prev = gc_target;
+#if COMPACT_LINES
+        for(long long p = lo / ARENA_CHUNK_SIZE; p <= (lo + live_bytes - 1) / ARENA_CHUNK_SIZE; p++) chunks[p] = gc_target;
+#endif
+    }
+    else {
+        above->prev = NULL;
+        free(gc_target);
+    }
+    gc_target = NULL;
+    kept_bytes = live_bytes;
+
+    free(regions);
+    free(live);
+    free(moved);
+    regions = NULL;
+    rg_len = 0;
+}
+
+// Visit every line handle kept by the text, the snapshots, the history logs
+// and the lifted deltas
+void ScanRoots(){
+#if TEXT_STORE == FLAT_STORE
+    ScanLines(text, t_len);
+#elif TEXT_STORE == GAP_STORE
+    ScanLines(text, g_start);
+    ScanLines(text + g_start + g_len, t_len - g_start);
+#elif TEXT_STORE == TREE_STORE
+    ScanTree(root);
+#else
+    // (pieces never share lines, and the added ones no piece holds may be
+    // of states freed since)
+    for(int i = 0; i < p_len; i++){
+        if(pieces[i].source == ORIGINAL) ScanLines(original + pieces[i].start, pieces[i].length);
+        else if(pieces[i].source == ADDED) ScanLines(added + pieces[i].start, pieces[i].length);
+    }
+#endif
+
+    ScanSnapshot(&base);
+    ScanSnapshot(&rightMost);
+    for(int i = 0; i < ck_len; i++) ScanSnapshot(&checkpoints[i].text);
+    for(int i = 0; i < vc_len; i++) ScanSnapshot(&cache[i].text);
+
+#if PERSISTENT_TREE
+    for(int i = 0; i < max(stateCount, reclaim_to); i++) ScanTree(history[i].version);
+    for(int i = 0; i < br_len; i++){
+        for(int j = 0; branches[i].states != NULL && j < branches[i].len; j++) ScanTree(branches[i].states[j].version);
+    }
+#endif
+
+    for(int b = 0; b < bl_len; b++){
+        // (spilled bodies are never in the arena)
+        if(SPILL_BODIES && blocks[b].spilled) continue;
+#if COLD_HISTORY
+        if(BlockPacked(b)){
+            ScanPacked(b);
+            continue;
+        }
+#endif
+        ScanLines(blocks[b].pool, blocks[b].p_len);
+    }
+
+    for(int k = 1; k < LIFT_LEVELS; k++){
+        for(int j = 0; j < lifts[k].cap; j++){
+            if(lifts[k].redo[j] != NULL) ScanLines(lifts[k].redo[j]->lines, lifts[k].redo[j]->l_len);
+            if(lifts[k].undo[j] != NULL) ScanLines(lifts[k].undo[j]->lines, lifts[k].undo[j]->l_len);
+        }
+    }
+}
+
+void ScanLines(line_t *lines, int count){
+    for(int i = 0; i < count; i++) RelocateLine(&lines[i]);
+}
+
+// Shared nodes are visited once: the mark pass flips their refs negative,
+// the move pass flips them back
+void ScanTree(node_t *n){
+    if(n == NULL || (n->refs < 0) == (gc_pass == MARK_LIVE)) return;
+    n->refs = -n->refs;
+    ScanLines(n->lines, n->fill);
+    ScanTree(n->left);
+    ScanTree(n->right);
+}
+
+void ScanSnapshot(snapshot_t *s){
+#if TEXT_STORE == TREE_STORE
+    ScanTree(s->version);
+#else
+    // Shared pages are visited once, the same way as tree nodes
+    for(int p = 0; p < s->pg_len; p++){
+        page_t *page = s->pages[p];
+        if(page == NULL || (page->refs < 0) == (gc_pass == MARK_LIVE)) continue;
+        page->refs = -page->refs;
+        ScanLines(page->lines, PageLength(s, p));
+    }
+#endif
+}
+
+#if COLD_HISTORY
+// Visit the pool of a packed block, packing it again if lines moved
+void ScanPacked(int b){
+    block_t *k = &blocks[b];
+    unsigned char *buffer = (unsigned char*)malloc(k->raw);
+    if(k->spilled){
+        void *map;
+        size_t map_len;
+        DecompressBytes(MapBlock(b, &map, &map_len), k->size, buffer);
+        munmap(map, map_len);
+    }
+    else DecompressBytes(k->data, k->size, buffer);
+
+    // (the pool follows the records, copy it out to get it aligned)
+    int edits = k->e_len * sizeof(edit_t);
+    line_t *pool = (line_t*)malloc(max(k->p_len, 1) * sizeof(line_t));
+    memcpy(pool, buffer + edits, k->p_len * sizeof(line_t));
+    ScanLines(pool, k->p_len);
+
+    if(gc_pass == MOVE_LIVE && memcmp(pool, buffer + edits, k->p_len * sizeof(line_t)) != 0){
+        memcpy(buffer + edits, pool, k->p_len * sizeof(line_t));
+        char spilled = k->spilled;
+        k->spilled = 0;
+        RepackBlock(b, buffer);
+        if(spilled) SpillBlock(b);
+    }
+    free(pool);
+    free(buffer);
+}
+#endif
+
+// Mark or move the slot holding the body of a line, if it is being compacted
+void RelocateLine(line_t *line){
+#if INLINE_LINES
+    if(line->tag) return;
+#endif
+    char *body = LineBody(line);
+    region_t *r = body == NULL ? NULL : FindRegion(body);
+    if(r == NULL) return;
+
+    int size;
+    char *slot = LineSlot(line, &size);
+    long long bit = r->bit + (slot - r->chunk->data) / 8;
+    if(gc_pass == MARK_LIVE){
+        if(!(live[bit >> 3] & (1 << (bit & 7)))) live_bytes += size;
+        live[bit >> 3] |= 1 << (bit & 7);
+        return;
+    }
+
+    int offset;
+    if(!(moved[bit >> 3] & (1 << (bit & 7)))){
+        offset = gc_target->used;
+        memcpy(gc_target->data + offset, slot, size);
+        memcpy(body, &offset, sizeof(int));
+        gc_target->used += size;
+        moved[bit >> 3] |= 1 << (bit & 7);
+    }
+    else memcpy(&offset, body, sizeof(int));
+
+    char *copy = gc_target->data + offset + (body - slot);
+#if COMPACT_LINES
+    line->ref = (gc_target->base + (copy - gc_target->data)) >> 2;
+#if INTERN_LINES
+    // A moved entry keeps the handle of its new body
+    if(body - slot == offsetof(entry_t, body)) ((entry_t*)(gc_target->data + offset))->line = *line;
+#endif
+#else
+    line->body = copy;
+#endif
+}
+
+// Slot (ArenaAlloc block) holding the body of a line, and its size
+char *LineSlot(line_t *line, int *size){
+    char *body = LineBody(line);
+    int length = LineLength(line);
+#if INTERN_LINES
+    // Lines InternLine doesn't keep in the handle live in a table entry
+#if COMPACT_LINES
+    if(length > INLINE_SIZE){
+#else
+    {
+#endif
+        *size = (sizeof(entry_t) + length + 1 + 7) & ~7;
+        return body - offsetof(entry_t, body);
+    }
+#endif
+#if COMPACT_LINES
+    *size = (sizeof(int) + length + 1 + 7) & ~7;
+    return body - sizeof(int);
+#else
+    *size = (length + 1 + 7) & ~7;
+    return body;
+#endif
+}
+
+// Region of the chunk holding address p, if it is being compacted
+region_t *FindRegion(char *p){
+    int lo = 0, hi = rg_len - 1;
+    while(lo <= hi){
+        int mid = (lo + hi) / 2;
+        chunk_t *c = regions[mid].chunk;
+        if((uintptr_t)p < (uintptr_t)c->data) hi = mid - 1;
+        else if((uintptr_t)p >= (uintptr_t)(c->data + c->used)) lo = mid + 1;
+        else return &regions[mid];
+    }
+    return NULL;
+}
+
+int CompareRegions(const void *a, const void *b){
+    uintptr_t x = (uintptr_t)((region_t*)a)->chunk, y = (uintptr_t)((region_t*)b)->chunk;
+    return (x > y) - (x < y);
+}
+
+// Point the intern table at the moved entries, the ones left behind had no
+// line referring to them anymore
+void RelinkEntries(){
+#if INTERN_LINES
+    for(int i = 0; i < b_cap; i++){
+        entry_t **link = &buckets[i];
+        while(*link != NULL){
+            entry_t *e = *link;
+            region_t *r = FindRegion((char*)e);
+            if(r == NULL){
+                link = &e->next;
+                continue;
+            }
+            long long bit = r->bit + ((char*)e - r->chunk->data) / 8;
+            if(moved[bit >> 3] & (1 << (bit & 7))){
+                int offset;
+                memcpy(&offset, e->body, sizeof(int));
+                *link = (entry_t*)(gc_target->data + offset);
+                link = &(*link)->next;
+            }
+            else {
+                *link = e->next;
+                entries--;
+            }
+        }
+    }
+#endif
+}
+
 /* ===================================================================== */
-/* Function declarations */
+/* History log support */
+
+// Append the record of the state the edit creates to the log of its
+// block. The pointer is good until the next record is appended.
+edit_t *GetStateEdit(){
+    int state = currentState + 1;
+    int b = state / COLD_BLOCK_STATES;
+    if(b >= bl_len){
+        blocks = (block_t*)FitCapacity(blocks, &bl_cap, b + 1, EDIT_BLOCK_SIZE, sizeof(block_t));
+        memset(blocks + bl_len, 0, (b + 1 - bl_len) * sizeof(block_t));
+        bl_len = b + 1;
+    }
+#if COLD_HISTORY
+    if(BlockPacked(b)) UnpackBlock(b);
+#endif
+
+    block_t *k = &blocks[b];
+    k->edits = (edit_t*)FitCapacity(k->edits, &k->e_cap, k->e_len + 1, EDIT_BLOCK_SIZE, sizeof(edit_t));
+    edit_t *e = &k->edits[k->e_len];
+    memset(e, 0, sizeof(edit_t));
+    e->lines = k->p_len;
+    history[state].edit = k->e_len++;
+    return e;
+}
 
-void AdjustCapacity(int required_lines);
-void SetTextCapacity(int capacity);
-void SetTextLength(int length);
-void SetLine(int location, char **content);
+void SetupEdit(edit_t *e, char code, int loc, int before, int after, int size){
+    e->code = code;
+    e->location = loc;
+    e->before = before;
+    e->after = after;
+    e->size = size;
+    e->taken = 0;
+    e->fill = 0;
+}
 
-void UpdateHistory();
-void FreeStateContent(int index);
-edit_t *GetStateEdit(char which);
-void SetupEdit(edit_t *e, char code, int loc, int setl, int size);
-void AddLineToEdit(edit_t *e, char **lineContent);
+// Add count lines to the pool after the ones of the record GetStateEdit
+// made (the last one of its block), returning where they go
+line_t *ExtendEdit(int count){
+    block_t *k = &blocks[(currentState + 1) / COLD_BLOCK_STATES];
+    k->pool = (line_t*)FitCapacity(k->pool, &k->p_cap, k->p_len + count, TEXT_BLOCK_SIZE, sizeof(line_t));
+    k->p_len += count;
+    return k->pool + k->p_len - count;
+}
 
-void OnQuit();
-void OnPrint(int from, int to);
-void OnChange(int from, int to);
-void OnDelete(int from, int to);
-void OnUndo(int steps);
-void OnRedo(int steps);
+void AddLineToEdit(edit_t *e, line_t *lineContent){
+    // Add line to edit and increase counter
+    *ExtendEdit(1) = (*lineContent);
+    e->fill++;
+}
 
-void QueueUndos(int amount);
-void QueueRedos(int amount);
-void RestoreEdits();
+// Lines of the record of state, the taken ones first (its block must be unpacked)
+line_t *EditLines(int state, edit_t *e){
+    return blocks[state / COLD_BLOCK_STATES].pool + e->lines;
+}
 
-void TryRestoreState();
+// Drop the records from cut on from the log of state's block
+void CutLog(int state, int cut){
+    block_t *k = &blocks[state / COLD_BLOCK_STATES];
+    k->p_len = k->edits[cut].lines;
+    k->e_len = cut;
+}
+
+// Free the log of block b, packed or not
+void FreeBlock(int b){
+    if(BlockPacked(b)){
+        cold_raw -= blocks[b].raw;
+        cold_size -= blocks[b].size;
+    }
+    free(blocks[b].data);
+    free(blocks[b].edits);
+    free(blocks[b].pool);
+    memset(&blocks[b], 0, sizeof(block_t));
+}
 
 /* ===================================================================== */
-/* Globals */
+/* Lifted delta support */
 
-char **text;    // Text container
-int t_cap = 0;  // Text capacity
-int t_len = 0;  // Text length
+delta_t *NewDelta(int length){
+    delta_t *d = (delta_t*)calloc(1, sizeof(delta_t));
+    d->length = length;
+    return d;
+}
 
-char *in_buf = NULL;    // Buffer for all things input
-size_t in_size = 0;     // Size of the buffer
-ssize_t in_len = 0;     // Length of the input line
+void FreeDelta(delta_t *d){
+    if(d == NULL) return;
+    free(d->runs);
+    free(d->lines);
+    free(d);
+}
 
-char status = 0;    // Program status (aka what action is being performed)
+// Append count lines to what d leads to, merging with the last run if possible
+void AddRun(delta_t *d, int from, int count, line_t *lines){
+    if(count <= 0) return;
 
-state_t *history;       // Edit timeline
-int h_cap = 0;          // Allocated blocks
-int stateCount = 0;     // Max time
-int currentState = 0;   // Current time
+    if(from < 0){
+        d->lines = (line_t*)FitCapacity(d->lines, &d->l_cap, d->l_len + count, TEXT_BLOCK_SIZE, sizeof(line_t));
+        memcpy(d->lines + d->l_len, lines, count * sizeof(line_t));
+        d->l_len += count;
+    }
 
-int actions_to_restore = 0; // Undo/Redo queue
+    run_t *last = d->r_len > 0 ? &d->runs[d->r_len - 1] : NULL;
+    if(last != NULL && ((from < 0 && last->from < 0) || (from >= 0 && last->from >= 0 && last->from + last->count == from))){
+        last->count += count;
+        return;
+    }
+    d->runs = (run_t*)FitCapacity(d->runs, &d->r_cap, d->r_len + 1, EDIT_BLOCK_SIZE, sizeof(run_t));
+    d->runs[d->r_len].from = from;
+    d->runs[d->r_len].count = count;
+    d->r_len++;
+}
 
-char **rightMost = NULL;    // Most recent copy of the whole text before any undos are performed
-int rm_len = 0;             // # of lines in the rightmost state
-int rm_state = 0;           // what state is it?
+// Delta of the single step from state to state + 1 (REDO) or back (UNDO)
+delta_t *StepDelta(int state, char which){
+    // Both ways it's the record of the edit that made state + 1
+    edit_t *e = StateEdit(state + 1);
+    line_t *lines = EditLines(state + 1, e);
+    int k = e->location - 1;
+
+    delta_t *d = NewDelta(which == REDO ? e->before : e->after);
+    switch (e->code){
+    case CHANGE:
+        AddRun(d, 0, k, NULL);
+        if(which == REDO){
+            AddRun(d, -1, e->fill, lines + e->taken);
+            AddRun(d, k + e->fill, e->after - (k + e->fill), NULL);
+        }
+        else {
+            AddRun(d, -1, e->taken, lines);
+            AddRun(d, k + e->taken, e->before - (k + e->taken), NULL);
+        }
+        break;
+    case DELETE:
+        AddRun(d, 0, k, NULL);
+        if(which == REDO) AddRun(d, k + e->size, e->before - (k + e->size), NULL);
+        else {
+            AddRun(d, -1, e->taken, lines);
+            AddRun(d, k, e->after - k, NULL);
+        }
+        break;
+    default:
+        AddRun(d, 0, e->before, NULL);
+    }
+    return d;
+}
 
-/* ===================================================================== */
-/* Main */
+// Delta of a followed by b. Edits never reorder lines, so the runs b keeps
+// go forward through what a leads to and a single pass does.
+delta_t *ComposeDeltas(delta_t *a, delta_t *b){
+    delta_t *d = NewDelta(a->length);
+    int r = 0, at = 0, a_lit = 0, b_lit = 0;
+    for(int i = 0; i < b->r_len; i++){
+        run_t *run = &b->runs[i];
+        if(run->from < 0){
+            AddRun(d, -1, run->count, b->lines + b_lit);
+            b_lit += run->count;
+            continue;
+        }
 
-int main(int argc, char* argv[]){
+        int pos = run->from, left = run->count;
+        while(left > 0){
+            // Run of a that pos falls in
+            while(at + a->runs[r].count <= pos){
+                at += a->runs[r].count;
+                if(a->runs[r].from < 0) a_lit += a->runs[r].count;
+                r++;
+            }
+            int skip = pos - at;
+            int n = min(left, a->runs[r].count - skip);
+            if(a->runs[r].from >= 0) AddRun(d, a->runs[r].from + skip, n, NULL);
+            else AddRun(d, -1, n, a->lines + a_lit + skip);
+            pos += n;
+            left -= n;
+        }
+    }
+    return d;
+}
 
-    // Init text
-    SetTextCapacity(TEXT_BLOCK_SIZE);
+// Delta of stride 2^k number j, composing (and keeping) the halves if needed
+delta_t *LiftedDelta(int k, int j, char which){
+    if(k == 0) return StepDelta(j, which);
+
+    lift_t *l = &lifts[k];
+    if(j >= l->cap){
+        int cap = max(2 * l->cap, j + 1);
+        l->redo = (delta_t**)realloc(l->redo, cap * sizeof(delta_t*));
+        l->undo = (delta_t**)realloc(l->undo, cap * sizeof(delta_t*));
+        memset(l->redo + l->cap, 0, (cap - l->cap) * sizeof(delta_t*));
+        memset(l->undo + l->cap, 0, (cap - l->cap) * sizeof(delta_t*));
+        l->cap = cap;
+    }
+    delta_t **slot = which == REDO ? &l->redo[j] : &l->undo[j];
+    if(*slot != NULL) return *slot;
+
+    delta_t *first = LiftedDelta(k - 1, which == REDO ? 2 * j : 2 * j + 1, which);
+    delta_t *second = LiftedDelta(k - 1, which == REDO ? 2 * j + 1 : 2 * j, which);
+    *slot = ComposeDeltas(first, second);
+    lift_bytes += DeltaBytes(*slot);
+    // Single steps are cheaper to build again than to keep
+    if(k == 1){
+        FreeDelta(first);
+        FreeDelta(second);
+    }
+    return *slot;
+}
 
-    // Init history (count = 1, current = 0)
-    UpdateHistory();
+// Turn the text d starts from into the one it leads to, one hunk (lines
+// dropped between two kept runs and the lines taking their place) at a time
+void ApplyDelta(delta_t *d){
+    int out = 0, src = 0, lit = 0, lits = 0;
+    for(int r = 0; r <= d->r_len; r++){
+        if(r < d->r_len && d->runs[r].from < 0){
+            lits += d->runs[r].count;
+            continue;
+        }
 
-    int arg1, arg2;
-    while(status != QUIT){
-        // Get input
-        in_buf = NULL;
-        in_len = getline(&in_buf, &in_size, stdin);
-        
-        // Execute input
-        switch (status = in_buf[in_len - 2]){
-            case PRINT:
-                RestoreEdits();
-                sscanf(in_buf, "%d,%dp", &arg1, &arg2);
-                OnPrint(arg1, arg2);
-                break;
-            case CHANGE:
-                RestoreEdits(); 
-                sscanf(in_buf, "%d,%dc", &arg1, &arg2);
-                OnChange(arg1, arg2);
-                break;
-            case DELETE:
-                RestoreEdits();
-                sscanf(in_buf, "%d,%dd", &arg1, &arg2);
-                OnDelete(arg1, arg2);
-                break;
-            case UNDO:
-                sscanf(in_buf, "%du", &arg1);
-                QueueUndos(arg1);
-                break;
-            case REDO:
-                sscanf(in_buf, "%dr", &arg1);
-                QueueRedos(arg1);
-                break;
+        int upto = r < d->r_len ? d->runs[r].from : d->length;
+        int gone = upto - src;
+        int same = min(gone, lits);
+        if(same > 0) SetLines(out + 1, d->lines + lit, same);
+        if(gone > lits) RemoveLines(out + 1 + same, gone - lits);
+        else if(lits > gone) InsertLines(out + 1 + same, d->lines + lit + same, lits - gone);
+        out += lits;
+        lit += lits;
+        lits = 0;
+
+        if(r < d->r_len){
+            out += d->runs[r].count;
+            src = upto + d->runs[r].count;
+        }
+    }
+}
+
+// Biggest stride a jump of steps from state can take (state is a multiple of it)
+int LiftLevel(int state, int steps){
+    int k = 0;
+    while(k + 1 < LIFT_LEVELS && state % (2 << k) == 0 && (2 << k) <= steps) k++;
+    return k;
+}
+
+long long DeltaBytes(delta_t *d){
+    return sizeof(delta_t) + (long long)d->r_cap * sizeof(run_t) + (long long)d->l_cap * sizeof(line_t);
+}
+
+void ForgetDelta(delta_t **slot){
+    if(*slot == NULL) return;
+    lift_bytes -= DeltaBytes(*slot);
+    FreeDelta(*slot);
+    *slot = NULL;
+}
+
+// Forget the deltas that reach past state
+void DropDeltas(int state){
+    for(int k = 1; k < LIFT_LEVELS; k++){
+        for(int j = max(0, state >> k); j < lifts[k].cap; j++){
+            if(((long long)(j + 1) << k) <= state) continue;
+            ForgetDelta(&lifts[k].redo[j]);
+            ForgetDelta(&lifts[k].undo[j]);
+        }
+    }
+}
+
+// Forget deltas from the highest stride down until they fit in LIFT_BYTES:
+// those are the biggest and the least likely to be taken again
+void TrimDeltas(){
+    for(int k = LIFT_LEVELS - 1; k > 0 && lift_bytes > LIFT_BYTES; k--){
+        for(int j = 0; j < lifts[k].cap && lift_bytes > LIFT_BYTES; j++){
+            ForgetDelta(&lifts[k].redo[j]);
+            ForgetDelta(&lifts[k].undo[j]);
         }
     }
-    return 0;
 }
 
 /* ===================================================================== */
-/* Text support */
+/* Branch support */
+
+// Move the states after fork into a new branch (their records and lines
+// stay where they are)
+void SaveBranch(int fork){
+    branches = (branch_t*)FitCapacity(branches, &br_cap, br_len + 1, EDIT_BLOCK_SIZE, sizeof(branch_t));
+    int id = ++br_len;
+    branch_t *b = &branches[id - 1];
+    memset(b, 0, sizeof(branch_t));
+    b->fork = folded + fork;
+    b->len = stateCount - 1 - fork;
+    b->states = (state_t*)malloc(b->len * sizeof(state_t));
+    memcpy(b->states, history + fork + 1, b->len * sizeof(state_t));
+
+    // Branches hanging from the states that were moved go with them: the
+    // last ones of the current branch's
+    int moved = br_last;
+    while(moved != 0 && branches[moved - 1].prev != 0 && branches[branches[moved - 1].prev - 1].fork > b->fork) moved = branches[moved - 1].prev;
+    if(moved != 0 && branches[moved - 1].fork > b->fork){
+        b->first = moved;
+        b->last = br_last;
+        br_last = branches[moved - 1].prev;
+        if(br_last != 0) branches[br_last - 1].next = 0;
+        else br_first = 0;
+        branches[moved - 1].prev = 0;
+        for(int c = moved; c != 0; c = branches[c - 1].next) branches[c - 1].parent = id;
+    }
 
-void SetTextCapacity(int capacity){
-    t_cap = capacity;
-    text = (char**)realloc(text, t_cap * sizeof(char*));
+    // Its fork is the latest one left on the current branch
+    LinkBranch(id);
 }
 
-void AdjustTextCapacity(int required_lines)
-{
-    int capacity = t_cap;
+// Free branch id and the ones hanging from it (their records stay in the
+// logs until their blocks go)
+void KillBranch(int id){
+    branch_t *b = &branches[id - 1];
+    if(b->states == NULL) return;
+#if PERSISTENT_TREE
+    for(int i = 0; i < b->len; i++) FreeTree(b->states[i].version);
+#endif
+    free(b->states);
+    b->states = NULL;
+    UnlinkBranch(id);
+
+    while(b->first != 0) KillBranch(b->first);
+}
+
+// Go to the state branch id hangs from and make it the future: the states
+// after it become a branch of their own
+void OnBranch(int id){
+    if(id < 1 || id > br_len || branches[id - 1].states == NULL) return;
 
-    if(required_lines < capacity) {
-        // Decrease capacity to trim out any non required text space
-        while(capacity - TEXT_BLOCK_SIZE >= required_lines) capacity -= TEXT_BLOCK_SIZE;
+    // Put the branch it hangs from on the current one first
+    if(branches[id - 1].parent != 0) OnBranch(branches[id - 1].parent);
+
+    int fork = branches[id - 1].fork - folded;
+    actions_to_restore = fork - currentState;
+    RestoreEdits();
+
+    if(stateCount - 1 > fork) SaveBranch(fork);
+    if(rm_state > fork){
+        FreeSnapshot(&rightMost);
+        rm_state = 0;
     }
-    else {
-        // Increase capacity to fit the required text size
-        while(required_lines > capacity) capacity += TEXT_BLOCK_SIZE;
+    DropCheckpoints(fork);
+    DropDeltas(fork);
+    DropCachedVersions(fork);
+
+    branch_t *b = &branches[id - 1];
+    stateCount = fork + 1 + b->len;
+    history = (state_t*)FitCapacity(history, &h_cap, stateCount, EDIT_BLOCK_SIZE, sizeof(state_t));
+    memcpy(history + fork + 1, b->states, b->len * sizeof(state_t));
+    free(b->states);
+    b->states = NULL;
+    UnlinkBranch(id);
+
+    // The branches hanging from it now hang from the current one, after
+    // all of its others (their forks are past this one)
+    for(int c = b->first; c != 0; c = branches[c - 1].next) branches[c - 1].parent = 0;
+    if(b->first != 0){
+        if(br_last != 0) branches[br_last - 1].next = b->first;
+        else br_first = b->first;
+        branches[b->first - 1].prev = br_last;
+        br_last = b->last;
+    }
+    b->first = b->last = 0;
+}
+
+int *FirstChild(int parent){
+    return parent == 0 ? &br_first : &branches[parent - 1].first;
+}
+
+int *LastChild(int parent){
+    return parent == 0 ? &br_last : &branches[parent - 1].last;
+}
+
+// Append branch id to the branches hanging from its parent
+void LinkBranch(int id){
+    branch_t *b = &branches[id - 1];
+    int *last = LastChild(b->parent);
+    b->prev = *last;
+    b->next = 0;
+    if(*last != 0) branches[*last - 1].next = id;
+    else *FirstChild(b->parent) = id;
+    *last = id;
+}
+
+void UnlinkBranch(int id){
+    branch_t *b = &branches[id - 1];
+    if(b->prev != 0) branches[b->prev - 1].next = b->next;
+    else *FirstChild(b->parent) = b->next;
+    if(b->next != 0) branches[b->next - 1].prev = b->prev;
+    else *LastChild(b->parent) = b->prev;
+    b->prev = b->next = 0;
+}
+
+/* ===================================================================== */
+/* Checkpoint support */
+
+// Estimated work of applying e either way: the lines written, blanked or
+// dropped
+int EditCost(edit_t *e){
+    int cost = 1 + e->size;
+    if(e->code == CHANGE) cost += abs(e->after - e->before);
+#if TEXT_STORE == FLAT_STORE
+    // Every line after a deleted (or reinserted) block is moved
+    if(e->code == DELETE) cost += e->before - (e->location - 1 + e->size);
+#endif
+    return cost;
+}
+
+// Account for an edit that just created currentState (and wrote that many
+// lines), checkpointing it if the lines written since the last checkpoint
+// are worth it
+void SaveCheckpoint(int written){
+#if CHECKPOINTS && !PERSISTENT_TREE
+    ck_written += written;
+    if(ck_written < (long long)max(TextLength(), CHECKPOINT_MIN_WORK) * ck_ratio) return;
+    ck_written = 0;
+
+    if(++ck_idle >= CHECKPOINT_PATIENCE){
+        ck_ratio = min(2 * ck_ratio, CHECKPOINT_MAX_RATIO);
+        ck_idle = 0;
     }
 
-    SetTextCapacity(capacity);
+    checkpoints = (checkpoint_t*)FitCapacity(checkpoints, &ck_cap, ck_len + 1, EDIT_BLOCK_SIZE, sizeof(checkpoint_t));
+    checkpoint_t *c = &checkpoints[ck_len];
+    c->state = currentState;
+    memset(&c->text, 0, sizeof(snapshot_t));
+    ShareSnapshot(&c->text, ck_len > 0 ? &checkpoints[ck_len - 1].text : NULL);
+    ck_len++;
+    // (what the tree store's copies hold grows as the text moves on)
+    RecountCheckpoints();
+    ThinCheckpoints();
+#endif
 }
 
-void SetTextLength(int length){
-    t_len = length;
-    AdjustTextCapacity(t_len);
+// Forget the checkpoints of the states after state
+void DropCheckpoints(int state){
+    int dropped = 0;
+    while(ck_len > 0 && checkpoints[ck_len - 1].state > state){
+        ck_len--;
+        FreeSnapshot(&checkpoints[ck_len].text);
+        dropped = 1;
+    }
+    if(dropped) RecountCheckpoints();
+}
+
+// Drop every other checkpoint (the newest stays) while their copies take
+// more memory than the history (as packed)
+void ThinCheckpoints(){
+    while(ck_len > 1 && ck_bytes > history[currentState].bytes - cold_raw + cold_size){
+        int kept = 0;
+        for(int i = 0; i < ck_len; i++){
+            if((ck_len - 1 - i) % 2 == 1) FreeSnapshot(&checkpoints[i].text);
+            else checkpoints[kept++] = checkpoints[i];
+        }
+        ck_len = kept;
+        ck_ratio = min(2 * ck_ratio, CHECKPOINT_MAX_RATIO);
+        RecountCheckpoints();
+    }
+}
+
+// Memory of the checkpoints, each one shares pages (or nodes) with the one
+// before
+void RecountCheckpoints(){
+    ck_bytes = 0;
+    for(int i = 0; i < ck_len; i++) ck_bytes += SnapshotBytes(&checkpoints[i].text, i > 0 ? &checkpoints[i - 1].text : NULL);
 }
 
-void SetLine(int location, char** content){
-    text[location-1] = (*content);
+// Index of the first checkpoint after state (ck_len if there is none)
+int NextCheckpoint(int state){
+    int lo = 0, hi = ck_len;
+    while(lo < hi){
+        int mid = (lo + hi) / 2;
+        if(checkpoints[mid].state <= state) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
 }
 
 /* ===================================================================== */
-/* History support */
+/* Version cache support */
+
+// Keep the current version around before undo/redo leaves it, if coming
+// back by replaying (replay) would cost more than restoring a copy
+void CacheVersion(long long replay){
+#if VERSION_CACHE_SIZE > 0
+#if TEXT_STORE != TREE_STORE
+    if(replay < TextLength()) return;
+#endif
+
+    // State 0, the rm state and the checkpoints can be restored already
+    int c = NextCheckpoint(currentState);
+    if(currentState == 0 || currentState == rm_state || (c > 0 && checkpoints[c - 1].state == currentState)) return;
+
+    // Look for it, and for the cached version most likely to share pages with it
+    int like = -1;
+    for(int i = 0; i < vc_len; i++){
+        if(cache[i].state == currentState){
+            cache[i].used = ++vc_clock;
+            return;
+        }
+        if(like < 0 || abs(cache[i].state - currentState) < abs(cache[like].state - currentState)) like = i;
+    }
 
-void UpdateHistory(){
+    long long bytes = (long long)TextLength() * sizeof(line_t);
+    if(bytes > VERSION_CACHE_BYTES) return;
 
-    // Making changes in the present
-    if(stateCount == 0 || currentState == stateCount-1){
-        // Increase count by one state and reallocate memory
-        stateCount++;
+    while(vc_len > 0 && (vc_len == VERSION_CACHE_SIZE || vc_bytes + bytes > VERSION_CACHE_BYTES)){
+        int lru = 0;
+        for(int i = 1; i < vc_len; i++){
+            if(cache[i].used < cache[lru].used) lru = i;
+        }
+        EvictVersion(lru);
+        // The last entry took the place of the evicted one
+        if(like == lru) like = -1;
+        else if(like == vc_len) like = lru;
     }
-    // Making changes in the past
-    else {
-        // Deallocate old states
-        for(int i = currentState + 1; i < stateCount; i++){
-            FreeStateContent(i);
+
+    cache = (cached_t*)FitCapacity(cache, &vc_cap, vc_len + 1, VERSION_CACHE_SIZE, sizeof(cached_t));
+    cached_t *v = &cache[vc_len++];
+    v->state = currentState;
+    v->used = ++vc_clock;
+    memset(&v->text, 0, sizeof(snapshot_t));
+    ShareSnapshot(&v->text, like >= 0 ? &cache[like].text : NULL);
+    vc_bytes += bytes;
+#endif
+}
+
+void EvictVersion(int index){
+    vc_bytes -= (long long)cache[index].text.length * sizeof(line_t);
+    FreeSnapshot(&cache[index].text);
+    cache[index] = cache[--vc_len];
+}
+
+// Forget the cached versions of the states after state
+void DropCachedVersions(int state){
+    for(int i = vc_len - 1; i >= 0; i--){
+        if(cache[i].state > state) EvictVersion(i);
+    }
+}
+
+/* ===================================================================== */
+/* Cold history support */
+
+// LZ77 with LZ4 style sequences: a token (literal count << 4 | match length
+// - LZ_MIN_MATCH, 15 meaning "more in the next bytes"), the literals and a 2
+// byte offset. The last sequence only has literals.
+unsigned char *EmitSequence(unsigned char *out, unsigned char *literals, int l_len, int offset, int m_len){
+    int m_code = m_len > 0 ? m_len - LZ_MIN_MATCH : 0;
+    *out++ = (min(l_len, 15) << 4) | min(m_code, 15);
+
+    if(l_len >= 15){
+        int rest = l_len - 15;
+        for(; rest >= 255; rest -= 255) *out++ = 255;
+        *out++ = rest;
+    }
+    memcpy(out, literals, l_len);
+    out += l_len;
+
+    if(m_len > 0){
+        *out++ = offset & 0xFF;
+        *out++ = offset >> 8;
+        if(m_code >= 15){
+            int rest = m_code - 15;
+            for(; rest >= 255; rest -= 255) *out++ = 255;
+            *out++ = rest;
         }
-        // Set new size and reallocate
-        stateCount = currentState + 2;
     }
+    return out;
+}
 
-    int capacity = h_cap;
-    while(stateCount >= capacity) capacity += EDIT_BLOCK_SIZE;
-    while(stateCount < capacity - EDIT_BLOCK_SIZE) capacity -= EDIT_BLOCK_SIZE;
+// dest needs room for size + size / 255 + 16 bytes, returns the bytes used
+int CompressBytes(unsigned char *src, int size, unsigned char *dest){
+    static int table[1 << LZ_HASH_BITS];
+    memset(table, -1, sizeof(table));
+
+    unsigned char *out = dest;
+    int anchor = 0, pos = 0;
+    while(pos + LZ_MIN_MATCH <= size){
+        unsigned int seq;
+        memcpy(&seq, src + pos, sizeof(seq));
+        unsigned int h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int ref = table[h];
+        table[h] = pos;
+
+        if(ref < 0 || pos - ref > 0xFFFF || memcmp(src + ref, src + pos, LZ_MIN_MATCH) != 0){
+            pos++;
+            continue;
+        }
 
-    // Resize history space
-    if(capacity != h_cap) history = (state_t*)realloc(history, capacity * sizeof(state_t));
+        int len = LZ_MIN_MATCH;
+        while(pos + len < size && src[ref + len] == src[pos + len]) len++;
+        out = EmitSequence(out, src + anchor, pos - anchor, pos - ref, len);
+        pos += len;
+        anchor = pos;
+    }
+    out = EmitSequence(out, src + anchor, size - anchor, 0, 0);
+    return out - dest;
+}
 
-    // Initialize new state
-    history[stateCount - 1].undo = NULL;
-    history[stateCount - 1].redo = NULL;
+void DecompressBytes(unsigned char *src, int size, unsigned char *dest){
+    unsigned char *end = src + size;
+    while(src < end){
+        int token = *src++;
+
+        int l_len = token >> 4;
+        if(l_len == 15) do l_len += *src; while(*src++ == 255);
+        memcpy(dest, src, l_len);
+        dest += l_len;
+        src += l_len;
+        if(src >= end) break;
+
+        int offset = src[0] | (src[1] << 8);
+        src += 2;
+        int m_len = token & 15;
+        if(m_len == 15) do m_len += *src; while(*src++ == 255);
+        m_len += LZ_MIN_MATCH;
+
+        // Byte by byte: the match may overlap what it is copying
+        unsigned char *match = dest - offset;
+        for(int i = 0; i < m_len; i++) dest[i] = match[i];
+        dest += m_len;
+    }
+}
 
-    h_cap = capacity;
+// Move the log of block b into one compressed buffer
+void PackBlock(int b){
+    block_t *k = &blocks[b];
+    int edits = k->e_len * sizeof(edit_t);
+    int raw = edits + k->p_len * sizeof(line_t);
+
+    // (a block may have no lines, or even no records, and then no buffers)
+    unsigned char *buffer = (unsigned char*)malloc(max(raw, 1));
+    if(k->e_len > 0) memcpy(buffer, k->edits, edits);
+    if(k->p_len > 0) memcpy(buffer + edits, k->pool, k->p_len * sizeof(line_t));
+    free(k->edits);
+    free(k->pool);
+    k->edits = NULL;
+    k->pool = NULL;
+    k->e_cap = 0;
+    k->p_cap = 0;
+
+    unsigned char *packed = (unsigned char*)malloc(raw + raw / 255 + 16);
+    int size = CompressBytes(buffer, raw, packed);
+    free(buffer);
+
+    k->data = (unsigned char*)realloc(packed, size);
+    k->size = size;
+    k->raw = raw;
+    cold_raw += raw;
+    cold_size += size;
 }
 
-void FreeStateContent(int index){
-    
-    edit_t *e = history[index].undo;
-    if(e != NULL){
-        free(e);
-        history[index].undo = NULL;
+// Compress the unpacked log of packed block b again (after its lines changed)
+void RepackBlock(int b, unsigned char *buffer){
+    block_t *k = &blocks[b];
+    unsigned char *packed = (unsigned char*)malloc(k->raw + k->raw / 255 + 16);
+    int size = CompressBytes(buffer, k->raw, packed);
+    cold_size += size - k->size;
+    free(k->data);
+    k->data = (unsigned char*)realloc(packed, size);
+    k->size = size;
+}
+
+// Give block b its log back
+void UnpackBlock(int b){
+    block_t *k = &blocks[b];
+    unsigned char *buffer = (unsigned char*)malloc(k->raw);
+    if(k->spilled){
+        void *map;
+        size_t map_len;
+        DecompressBytes(MapBlock(b, &map, &map_len), k->size, buffer);
+        munmap(map, map_len);
+        k->spilled = 0;
     }
-    
-    e = history[index].redo;
-    if(e != NULL){
-        free(e);
-        history[index].redo = NULL;
+    else DecompressBytes(k->data, k->size, buffer);
+
+    int edits = k->e_len * sizeof(edit_t);
+    k->e_cap = max(k->e_len, 1);
+    k->p_cap = max(k->p_len, 1);
+    k->edits = (edit_t*)malloc(k->e_cap * sizeof(edit_t));
+    k->pool = (line_t*)malloc(k->p_cap * sizeof(line_t));
+    memcpy(k->edits, buffer, edits);
+    memcpy(k->pool, buffer + edits, k->p_len * sizeof(line_t));
+    free(buffer);
+
+    cold_raw -= k->raw;
+    cold_size -= k->size;
+    free(k->data);
+    k->data = NULL;
+    cool_from = min(cool_from, b);
+    spill_from = min(spill_from, b);
+}
+
+// Pack every block that is now at least COLD_DISTANCE states behind
+void CoolHistory(){
+    while((cool_from + 1) * COLD_BLOCK_STATES <= currentState - COLD_DISTANCE){
+        if(!BlockPacked(cool_from)) PackBlock(cool_from);
+        cool_from++;
     }
-    
+
+#if DISK_HISTORY
+    int spilled = 0;
+    while(spill_from < cool_from && (spill_from + 1) * COLD_BLOCK_STATES <= currentState - SPILL_DISTANCE){
+        if(blocks[spill_from].data != NULL){
+            SpillBlock(spill_from);
+            spilled = 1;
+        }
+        spill_from++;
+    }
+    // The lines only spilled states stored are on disk now
+    if(SPILL_BODIES && spilled) CompactArena(history[spill_from * COLD_BLOCK_STATES].mark);
+#endif
+}
+
+int BlockPacked(int b){
+    return b < bl_len && (blocks[b].data != NULL || blocks[b].spilled);
 }
 
-edit_t* GetStateEdit(char which){
-    if(which == UNDO){
-        // If empty, generate (could do realloc/calloc but is it necessary?)
-        if(history[currentState + 1].undo == NULL) {
-            history[currentState + 1].undo = (edit_t*)malloc(sizeof(edit_t));
-            history[currentState + 1].undo->code = 0;
-            history[currentState + 1].undo->location = 0;
-            history[currentState + 1].undo->size = 0;
-            history[currentState + 1].undo->setlen = 0;
-            history[currentState + 1].undo->lines = NULL;
+// Append the packed data of block b to the history log. The log only
+// grows: unpacking a block doesn't give its bytes back.
+void SpillBlock(int b){
+    if(log_fd < 0){
+        FILE *log = tmpfile();
+        if(log == NULL){
+            perror("history log");
+            exit(1);
         }
-        return history[currentState+1].undo;
+        log_fd = dup(fileno(log));
+        fclose(log);
     }
-    // If empty, generate (could do realloc/calloc but is it necessary?)
-    if(history[currentState].redo == NULL){
-        history[currentState].redo = (edit_t*)malloc(sizeof(edit_t));
-        history[currentState].redo->code = 0;
-        history[currentState].redo->location = 0;
-        history[currentState].redo->size = 0;
-        history[currentState].redo->setlen = 0;
-        history[currentState].redo->lines = NULL;
+#if SPILL_BODIES
+    SpillBodies(b);
+#endif
+
+    if(pwrite(log_fd, blocks[b].data, blocks[b].size, log_size) != blocks[b].size){
+        perror("history log");
+        exit(1);
     }
+    free(blocks[b].data);
+    blocks[b].data = NULL;
+    blocks[b].spilled = 1;
+    blocks[b].offset = log_size;
+    log_size += blocks[b].size;
+}
 
-    return history[currentState].redo;
+#if SPILL_BODIES
+// Whether the line has a body outside its handle that isn't in the log yet
+// (a block spilled again after being unpacked keeps pointing to it there)
+int HasBody(line_t *line){
+#if INLINE_LINES
+    if(line->tag) return 0;
+#endif
+    if(line->body == NULL) return 0;
+    for(int i = sg_len - 1; i >= 0; i--){
+        if(line->body >= segments[i].map && line->body < segments[i].map + segments[i].size) return 0;
+    }
+    return 1;
 }
 
-void SetupEdit(edit_t *e, char code, int loc, int setl, int size){
-    e->code = code;
-    e->location = loc;
-    e->setlen = setl;
-    e->size = size;
-    e->fill = 0;
-    e->lines = NULL;
-    e->lines = (char**)realloc(e->lines, size * sizeof(char*));
+// Segment with room for length more bytes of bodies: the last one, or a new
+// one reserved past the end of the log if they don't fit. The mapping is
+// shared, so it sees what is written to the log after it was made.
+segment_t *BodySpace(long long length){
+    segment_t *g = sg_len > 0 ? &segments[sg_len - 1] : NULL;
+    if(g == NULL || g->size - g->used < length){
+        long long page = sysconf(_SC_PAGESIZE);
+        segments = (segment_t*)FitCapacity(segments, &sg_cap, sg_len + 1, 16, sizeof(segment_t));
+        g = &segments[sg_len++];
+        g->offset = (log_size + page - 1) / page * page;
+        g->size = (max(length, BODY_SEGMENT) + page - 1) / page * page;
+        g->used = 0;
+        g->map = (char*)mmap(NULL, g->size, PROT_READ, MAP_SHARED, log_fd, g->offset);
+        if(g->map == MAP_FAILED){
+            perror("history log");
+            exit(1);
+        }
+        // (the rest of the segment stays a hole in the file until filled)
+        log_size = g->offset + g->size;
+    }
+    return g;
 }
 
-void AddLineToEdit(edit_t *e, char **lineContent){
-    // Add line to edit and increase counter
-    e->lines[e->fill] = (*lineContent);
-    e->fill++;
+// Append the bodies the pool of block b points to to the body segments of
+// the log and point the pool at them
+void SpillBodies(int b){
+    block_t *k = &blocks[b];
+    unsigned char *buffer = (unsigned char*)malloc(k->raw);
+    DecompressBytes(k->data, k->size, buffer);
+    int edits = k->e_len * sizeof(edit_t);
+    line_t *pool = (line_t*)malloc(max(k->p_len, 1) * sizeof(line_t));
+    memcpy(pool, buffer + edits, k->p_len * sizeof(line_t));
+
+    long long length = 0;
+    for(int i = 0; i < k->p_len; i++){
+        if(HasBody(&pool[i])) length += pool[i].length + 1;
+    }
+    if(length > 0){
+        // (document lines have no terminator of their own)
+        char *bodies = (char*)malloc(length), *cursor = bodies;
+        for(int i = 0; i < k->p_len; i++){
+            if(!HasBody(&pool[i])) continue;
+            memcpy(cursor, pool[i].body, pool[i].length);
+            cursor[pool[i].length] = '\0';
+            cursor += pool[i].length + 1;
+        }
+
+        segment_t *g = BodySpace(length);
+        if(pwrite(log_fd, bodies, length, g->offset + g->used) != length){
+            perror("history log");
+            exit(1);
+        }
+        free(bodies);
+        char *map = g->map + g->used;
+        g->used += length;
+
+        for(int i = 0; i < k->p_len; i++){
+            if(!HasBody(&pool[i])) continue;
+            pool[i].body = map;
+            map += pool[i].length + 1;
+        }
+        memcpy(buffer + edits, pool, k->p_len * sizeof(line_t));
+        RepackBlock(b, buffer);
+    }
+    free(pool);
+    free(buffer);
+}
+#endif
+
+// Map the part of the log holding block b (map and map_len are what to unmap)
+unsigned char *MapBlock(int b, void **map, size_t *map_len){
+    long long start = blocks[b].offset & ~((long long)sysconf(_SC_PAGESIZE) - 1);
+    *map_len = blocks[b].offset - start + blocks[b].size;
+    *map = mmap(NULL, *map_len, PROT_READ, MAP_PRIVATE, log_fd, start);
+    if(*map == MAP_FAILED){
+        perror("history log");
+        exit(1);
+    }
+    return (unsigned char*)*map + (blocks[b].offset - start);
+}
+
+// Record of the edit that made a state, unpacking its block first if needed
+edit_t *StateEdit(int index){
+    int b = index / COLD_BLOCK_STATES;
+#if COLD_HISTORY
+    if(BlockPacked(b)) UnpackBlock(b);
+#endif
+    return history[index].edit < 0 ? NULL : &blocks[b].edits[history[index].edit];
 }
 
 /* ===================================================================== */
 /* Command events */
 
+void OnQuit(){
+#if REPORT_STATS
+    fprintf(stderr, "resizes: %d, bytes copied: %lld\n", resizes, copied_bytes);
+    fprintf(stderr, "interned lines: %d, bytes saved: %lld\n", entries, saved_bytes);
+    fprintf(stderr, "cold history: %lld bytes packed in %lld\n", cold_raw, cold_size);
+    long long unused = 0;   // (room left in the body segments is a hole)
+    for(int i = 0; i < sg_len; i++) unused += segments[i].size - segments[i].used;
+    fprintf(stderr, "history log: %lld bytes, %d body segments\n", log_size - unused, sg_len);
+    fprintf(stderr, "checkpoints: %d (every %d document lengths), %lld bytes\n", ck_len, ck_ratio, ck_bytes);
+    fprintf(stderr, "version cache: %d hits, %d misses, %d versions\n", vc_hits, vc_misses, vc_len);
+    fprintf(stderr, "lifted deltas: %lld bytes\n", lift_bytes);
+#endif
+}
+
 void OnPrint(int from, int to){
-    // Prind valid lines, replace invalid ones with '.'
-    for(int i = from; i <= to; i++){
-        if(i > 0 && i <= t_len) printf("%s", text[i-1]);
-        else printf(".\n");
+    // Valid lines are fetched SNAPSHOT_PAGE at a time, the rest is replaced with '.'
+    int first = max(from, 1);
+    int last = min(to, TextLength());
+
+    for(int i = from; i < first && i <= to; i++) printf(".\n");
+
+    if(first <= last) scratch = (line_t*)FitCapacity(scratch, &s_cap, min(last - first + 1, SNAPSHOT_PAGE), TEXT_BLOCK_SIZE, sizeof(line_t));
+    for(int at = first; at <= last; at += SNAPSHOT_PAGE){
+        int count = min(last - at + 1, SNAPSHOT_PAGE);
+        GetLines(at, count, scratch);
+        for(int i = 0; i < count; i++) fwrite(LineBody(&scratch[i]), 1, LineLength(&scratch[i]), stdout);
     }
+
+    for(int i = max(first, last + 1); i <= to; i++) printf(".\n");
 }
 
 void OnChange(int from, int to){
     
-    int prevLen = t_len;
-    // Expand/Trim text to fit
-    SetTextLength(max(to, prevLen));
+    int prevLen = TextLength();
+    int overwritten = max(0, min(to, prevLen) - from + 1);
 
     UpdateHistory();  // count = current + 2, current+1 is the undo's state
    
-    edit_t *undo = GetStateEdit(UNDO);
-    SetupEdit(undo, CHANGE, from, prevLen, to - from + 1);
-    
-    edit_t *redo = GetStateEdit(REDO);
-    SetupEdit(redo, CHANGE, from, t_len, to - from + 1);
+    edit_t *edit = GetStateEdit();
+    SetupEdit(edit, CHANGE, from, prevLen, max(to, prevLen), to - from + 1);
+
+    // Save the lines that are being overwritten (none past the end: the
+    // pool may not exist yet)
+    if(overwritten > 0) GetLines(from, overwritten, ExtendEdit(overwritten));
+    edit->taken = overwritten;
 
     for(int i = from; i <= to; i++){
         // Get input
-        in_buf = NULL;
         in_len = getline(&in_buf, &in_size, stdin);
-
-        // If line is being overwritten
-        if(i <= prevLen) {
-            AddLineToEdit(undo, &text[i-1]);
-        }
-
-        SetLine(i, &in_buf);
-        AddLineToEdit(redo, &in_buf);
+        line_t line = InternLine(in_buf, in_len);
+        AddLineToEdit(edit, &line);
     }
 
-    currentState++;
+    // Expand text to fit and write the new lines
+    SetTextLength(edit->after);
+    SetLines(from, EditLines(currentState + 1, edit) + edit->taken, edit->fill);
 
-    rm_state = 0;
+    currentState++;
+#if PERSISTENT_TREE
+    SaveVersion();
+#endif
+    CloseState(EditCost(edit));
 }
 
 void OnDelete(int from, int to){
-    if(from > t_len || to < 1) {
+    if(from > TextLength() || to < 1) {
         UpdateHistory();
     
-        edit_t *undo = GetStateEdit(UNDO);
-        SetupEdit(undo, SKIP, 0, 0, 0);
-    
-        edit_t *redo = GetStateEdit(REDO);
-        SetupEdit(redo, SKIP, 0, 0, 0);
+        edit_t *edit = GetStateEdit();
+        SetupEdit(edit, SKIP, 0, TextLength(), TextLength(), 0);
 
         currentState++;
+#if PERSISTENT_TREE
+        SaveVersion();
+#endif
+        CloseState(EditCost(edit));
         return;
     }
 
-    int lastToRemove = min(to, t_len);
+    int lastToRemove = min(to, TextLength());
     int offset = lastToRemove - from + 1;
 
     UpdateHistory();
     
-    edit_t *undo = GetStateEdit(UNDO);
-    SetupEdit(undo, DELETE, from, t_len, offset);
-    
-    edit_t *redo = GetStateEdit(REDO);
-    SetupEdit(redo, DELETE, from, t_len-offset, offset);
+    edit_t *edit = GetStateEdit();
+    SetupEdit(edit, DELETE, from, TextLength(), TextLength()-offset, offset);
+    GetLines(from, offset, ExtendEdit(offset));
+    edit->taken = offset;
 
-    int cursor = from - 1;
-    while(cursor < t_len){
-
-        if(cursor < lastToRemove){
-            AddLineToEdit(undo, &text[cursor]);
-        }
-
-        if(cursor + offset < t_len){
-            text[cursor] = text[cursor+offset];
-            text[cursor + offset] = NULL;
-        }
-        cursor++;
-    }
-
-    SetTextLength(t_len-offset);
+    RemoveLines(from, offset);
     currentState++;
-    rm_state = 0;
+#if PERSISTENT_TREE
+    SaveVersion();
+#endif
+    CloseState(EditCost(edit));
 }
 
 void OnUndo(int steps){
 
     if(currentState == stateCount - 1){
-        rightMost = (char**)realloc(rightMost, t_cap * sizeof(char*));
-        rm_len = t_len;
+        TrackSnapshot(&rightMost);
         rm_state = currentState;
-        for(int i = 0; i < rm_len; i++)
-            rightMost[i] = text[i];
     }
     
     edit_t *undo;
     while(currentState > 0 && steps > 0){
+#if LIFTED_DELTAS
+        // Far to go: take the biggest stride that ends here
+        int k = LiftLevel(currentState, min(steps, currentState));
+        if(k >= LIFT_MIN_LEVEL){
+            ApplyDelta(LiftedDelta(k, (currentState >> k) - 1, UNDO));
+            TrimDeltas();
+            steps -= 1 << k;
+            currentState -= 1 << k;
+            continue;
+        }
+#endif
         
-        undo = history[currentState].undo;
+        undo = StateEdit(currentState);
         switch (undo->code){
         case CHANGE:
             /* Undo Change ------------------ */
-            {
-                SetTextLength(undo->setlen);
-                for(int i = 0; i < undo->fill; i++){
-                    SetLine(undo->location + i, &undo->lines[i]);
-                }
-            }
+            SetTextLength(undo->before);
+            SetLines(undo->location, EditLines(currentState, undo), undo->taken);
             break;
         case DELETE:
             /* Undo Delete (do insert) ------ */
-            {
-                SetTextLength(undo->setlen);
-                int cursor = t_len;
-                while(cursor >= undo->location){
-                    // Inserting at the end
-                    if(t_len - undo->fill == undo->location - 1){
-                        SetLine(cursor, &undo->lines[cursor-undo->location]);
-                    } 
-                    // Inserting in the middle
-                    else {
-                        if(cursor-undo->fill > 0) text[cursor - 1] = text[cursor-undo->fill - 1];
-                        if(cursor <= undo->location + undo->fill - 1) SetLine(cursor, &undo->lines[cursor-undo->location]);
-                    }
-                    cursor--;
-                }
-            }
+            InsertLines(undo->location, EditLines(currentState, undo), undo->taken);
             break;
         }
         steps--;
@@ -392,32 +3263,28 @@ void OnRedo(int steps){
 
     edit_t *redo;
     while(currentState < stateCount - 1 && steps > 0){
+#if LIFTED_DELTAS
+        // Far to go: take the biggest stride that starts here
+        int k = LiftLevel(currentState, min(steps, stateCount - 1 - currentState));
+        if(k >= LIFT_MIN_LEVEL){
+            ApplyDelta(LiftedDelta(k, currentState >> k, REDO));
+            TrimDeltas();
+            steps -= 1 << k;
+            currentState += 1 << k;
+            continue;
+        }
+#endif
 
-        redo = history[currentState].redo;
+        redo = StateEdit(currentState + 1);
         switch (redo->code){
         case CHANGE:
             /* Redo Change ------------------ */
-            {
-                SetTextLength(redo->setlen);
-                for(int i = 0; i < redo->fill; i++){
-                    SetLine(redo->location + i, &redo->lines[i]);
-                }
-            }
+            SetTextLength(redo->after);
+            SetLines(redo->location, EditLines(currentState + 1, redo) + redo->taken, redo->fill);
             break;
         case DELETE:
             /* Redo Delete ------------------ */
-            {
-                int cursor = redo->location - 1;
-                while(cursor < t_len){
-
-                    if(cursor + redo->size < t_len){
-                        text[cursor] = text[cursor+redo->size];
-                        text[cursor + redo->size] = NULL;
-                    }
-                    cursor++;
-                }
-                SetTextLength(redo->setlen);
-            }
+            RemoveLines(redo->location, redo->size);
             break;
         }
         steps--;
@@ -438,12 +3305,19 @@ void QueueRedos(int amount){
 void RestoreEdits(){
 
     if(actions_to_restore == 0) return;
+
+#if PERSISTENT_TREE
+    // Every state keeps its own version of the text: just switch to it
+    RestoreVersion(currentState + actions_to_restore);
+#else
+    CacheVersion(llabs(history[currentState + actions_to_restore].work - history[currentState].work));
     TryRestoreState();
 
     if(actions_to_restore > 0)
         OnRedo(actions_to_restore);
     else if(actions_to_restore < 0)
         OnUndo(-actions_to_restore);
+#endif
     actions_to_restore = 0;
 }
 
@@ -451,24 +3325,64 @@ void TryRestoreState(){
 
     // Calculate target state
     int target = currentState+actions_to_restore;
-    
-    // Check if 0 or the rm state are closer to the target
-    if (actions_to_restore < 0 && target < -actions_to_restore){
-        actions_to_restore = target;
-        SetTextLength(0);
-        currentState = 0;
+    long long goal = history[target].work;
+
+    // Replay from wherever it costs the least: the current state, 0, the rm
+    // state or the checkpoints around the target (restoring one isn't free)
+    int start = currentState;
+    snapshot_t *point = NULL;
+    long long best = llabs(goal - history[currentState].work);
+
+    long long cost = RestoreCost(&base) + goal;
+    if(cost < best){
+        best = cost;
+        start = 0;
+        point = &base;
     }
-    else if(actions_to_restore > 0 && rm_state > 0){
-        
-        if(abs(target-rm_state)<actions_to_restore)
-        {
-            SetTextLength(rm_len);
-            currentState = rm_state;
-            for(int i = 0; i < rm_len; i++)
-                text[i] = rightMost[i];
-            actions_to_restore = target-rm_state;
+    if(rm_state > 0){
+        cost = RestoreCost(&rightMost) + llabs(goal - history[rm_state].work);
+        if(cost < best){
+            best = cost;
+            start = rm_state;
+            point = &rightMost;
         }
     }
+    int used = -1, hit = -1;
+    for(int i = 0; i < vc_len; i++){
+        cost = RestoreCost(&cache[i].text) + llabs(goal - history[cache[i].state].work);
+        if(cost < best){
+            best = cost;
+            start = cache[i].state;
+            point = &cache[i].text;
+            hit = i;
+        }
+    }
+    int next = NextCheckpoint(target);
+    for(int i = max(next - 1, 0); i <= min(next, ck_len - 1); i++){
+        cost = RestoreCost(&checkpoints[i].text) + llabs(goal - history[checkpoints[i].state].work);
+        if(cost < best){
+            best = cost;
+            start = checkpoints[i].state;
+            point = &checkpoints[i].text;
+            used = i;
+            hit = -1;
+        }
+    }
+
+    if(hit >= 0){
+        cache[hit].used = ++vc_clock;
+        vc_hits++;
+    }
+    else vc_misses++;
+
+    if(point == NULL) return;
+    if(used >= 0){
+        ck_ratio = max(ck_ratio / 2, 1);
+        ck_idle = 0;
+    }
+    RestoreSnapshot(point);
+    currentState = start;
+    actions_to_restore = target - start;
 }
 
 